@@ -0,0 +1,219 @@
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define ARENA_BLOCK_SIZE 65536
+#define ARENA_ALIGN sizeof(max_align_t)
+#define ARENA_NUM_CLASSES 64
+#define ARENA_LARGE_SIZE 16384
+
+typedef struct Arena Arena;
+typedef struct ArenaBlock arena_block_t;
+typedef struct ArenaLarge arena_large_t;
+typedef struct ArenaFree arena_free_t;
+
+struct ArenaBlock {
+  struct ArenaBlock *next;
+  size_t used;
+  max_align_t data[];
+};
+
+struct ArenaLarge {
+  struct ArenaLarge *next;
+  struct ArenaLarge *prev;
+  size_t size;
+  max_align_t data[];
+};
+
+struct ArenaFree {
+  struct ArenaFree *next;
+};
+
+struct Arena {
+  arena_block_t *blocks;
+  arena_large_t *large;
+  arena_free_t *free_lists[ARENA_NUM_CLASSES];
+  size_t bytes;
+};
+
+Arena *current_arena = NULL;
+
+static size_t arena_round(size_t size) {
+  if (size == 0)
+    size = 1;
+
+  return (size + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1);
+}
+
+static size_t arena_class_of(size_t size) { return size / ARENA_ALIGN - 1; }
+
+Arena *arena_new(void) {
+  Arena *arena = malloc(sizeof(Arena));
+
+  if (arena == NULL)
+    return NULL;
+
+  memset(arena, 0, sizeof(Arena));
+  return arena;
+}
+
+static void arena_release_blocks(Arena *arena, arena_block_t *keep) {
+  arena_block_t *block = arena->blocks;
+
+  while (block != NULL) {
+    arena_block_t *next = block->next;
+
+    if (block != keep) {
+      free(block);
+      arena->bytes -= sizeof(arena_block_t) + ARENA_BLOCK_SIZE;
+    }
+
+    block = next;
+  }
+
+  arena_large_t *large = arena->large;
+
+  while (large != NULL) {
+    arena_large_t *next = large->next;
+
+    arena->bytes -= sizeof(arena_large_t) + large->size;
+    free(large);
+    large = next;
+  }
+
+  arena->large = NULL;
+  memset(arena->free_lists, 0, sizeof(arena->free_lists));
+}
+
+void arena_destroy(Arena *arena) {
+  if (arena == NULL)
+    return;
+
+  if (current_arena == arena)
+    current_arena = NULL;
+
+  arena_release_blocks(arena, NULL);
+  free(arena);
+}
+
+void arena_reset(Arena *arena) {
+  arena_block_t *keep = arena->blocks;
+
+  // The first block is kept so a reset arena that is refilled to a similar
+  // size does not go straight back to malloc.
+  while (keep != NULL && keep->next != NULL)
+    keep = keep->next;
+
+  arena_release_blocks(arena, keep);
+
+  if (keep != NULL)
+    keep->used = 0;
+
+  arena->blocks = keep;
+}
+
+size_t arena_bytes(const Arena *arena) { return arena->bytes; }
+
+static void *arena_request_large(Arena *arena, size_t size) {
+  arena_large_t *large = malloc(sizeof(arena_large_t) + size);
+
+  if (large == NULL)
+    return NULL;
+
+  large->size = size;
+  large->prev = NULL;
+  large->next = arena->large;
+
+  if (arena->large != NULL)
+    arena->large->prev = large;
+
+  arena->large = large;
+  arena->bytes += sizeof(arena_large_t) + size;
+  return large->data;
+}
+
+void *request_memory(Arena *arena, size_t size) {
+  if (arena == NULL)
+    return NULL;
+
+  size = arena_round(size);
+
+  // Anything too big for a size class gets its own allocation so it can be
+  // handed straight back to the system once recycled.
+  if (size >= ARENA_LARGE_SIZE)
+    return arena_request_large(arena, size);
+
+  if (size <= ARENA_NUM_CLASSES * ARENA_ALIGN) {
+    arena_free_t **list = &arena->free_lists[arena_class_of(size)];
+
+    if (*list != NULL) {
+      arena_free_t *chunk = *list;
+      *list = chunk->next;
+      return chunk;
+    }
+  }
+
+  arena_block_t *block = arena->blocks;
+
+  if (block == NULL || ARENA_BLOCK_SIZE - block->used < size) {
+    block = malloc(sizeof(arena_block_t) + ARENA_BLOCK_SIZE);
+
+    if (block == NULL)
+      return NULL;
+
+    block->used = 0;
+    block->next = arena->blocks;
+    arena->blocks = block;
+    arena->bytes += sizeof(arena_block_t) + ARENA_BLOCK_SIZE;
+  }
+
+  void *memory = (char *)block->data + block->used;
+  block->used += size;
+  return memory;
+}
+
+void *duplicate_memory(Arena *arena, const void *source, size_t size) {
+  void *memory = request_memory(arena, size);
+
+  if (memory != NULL && size > 0)
+    memcpy(memory, source, size);
+
+  return memory;
+}
+
+void arena_recycle(Arena *arena, void *memory, size_t size) {
+  if (arena == NULL || memory == NULL)
+    return;
+
+  size = arena_round(size);
+
+  if (size >= ARENA_LARGE_SIZE) {
+    arena_large_t *large =
+        (arena_large_t *)((char *)memory - offsetof(arena_large_t, data));
+
+    if (large->prev != NULL)
+      large->prev->next = large->next;
+    else
+      arena->large = large->next;
+
+    if (large->next != NULL)
+      large->next->prev = large->prev;
+
+    arena->bytes -= sizeof(arena_large_t) + large->size;
+    free(large);
+    return;
+  }
+
+  // Mid-sized chunks have no class to go back to and stay put until the
+  // arena is reset or destroyed.
+  if (size > ARENA_NUM_CLASSES * ARENA_ALIGN)
+    return;
+
+  arena_free_t *chunk = memory;
+  arena_free_t **list = &arena->free_lists[arena_class_of(size)];
+
+  chunk->next = *list;
+  *list = chunk;
+}
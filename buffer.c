@@ -1,19 +1,121 @@
+#include <fcntl.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <uchar.h>
+#include <unistd.h>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#define GAP_BUFFER_MIN_GROWTH 64
+#define GAP_INDEX_BLOCK_SHIFT 6
+#define GAP_INDEX_BLOCK_SIZE (1 << GAP_INDEX_BLOCK_SHIFT)
+#define MAP_CHUNK_CHARS 65536
+#define TXT_NODE_MAX_ENTRIES 64
+#define TXT_NODE_MIN_ENTRIES (TXT_NODE_MAX_ENTRIES / 4)
+#define TXT_NODE_FILL_ENTRIES (TXT_NODE_MAX_ENTRIES * 3 / 4)
+
+extern Arena *current_arena;
 
 typedef struct GAPBuffer gap_buffer_t;
+typedef struct PIECENode piece_node_t;
+typedef struct PIECETable piece_table_t;
+typedef struct MAPFile map_file_t;
+typedef struct TXTNode txt_node_t;
+typedef struct TXTBuffer txt_buffer_t;
+typedef struct TXTIter txt_iter_t;
+typedef struct TXTDiff txt_diff_t;
 typedef struct ADDRBuffer addr_buffer_t;
 typedef struct REGEXPBuffer regexp_buffer_t;
 
 struct GAPBuffer {
-  char32_t *contents;
+  Arena *arena;
+  uint8_t *contents;
+  size_t *contents_refs;
   size_t contents_size;
+  unsigned width;
   size_t gap_start;
   size_t gap_end;
+  size_t *line_index;
+  size_t index_blocks;
+  bool index_deferred;
+  bool index_stale;
+};
+
+struct PIECENode {
+  bool in_added;
+  size_t offset;
+  size_t length;
+  size_t subtree_length;
+  uint32_t priority;
+  struct PIECENode *left;
+  struct PIECENode *right;
+};
+
+struct MAPFile {
+  Arena *arena;
+  void *mapping;
+  size_t mapping_size;
+  const char32_t *text;
+  size_t length;
+  bool swapped;
+  const char32_t **chunks;
+  size_t num_chunks;
+  size_t *line_counts;
+};
+
+struct TXTNode {
+  bool is_leaf;
+  size_t refs;
+  size_t num_entries;
+  size_t num_lines;
+  size_t mark;
+  union {
+    str_buffer_t *lines[TXT_NODE_MAX_ENTRIES];
+    struct TXTNode *children[TXT_NODE_MAX_ENTRIES];
+  };
+};
+
+struct TXTBuffer {
+  Arena *arena;
+  txt_node_t *root;
+  size_t num_lines;
+};
+
+struct TXTIter {
+  txt_buffer_t *buffer;
+  txt_node_t *leaf;
+  size_t slot;
+  size_t line_no;
+};
+
+struct TXTDiff {
+  size_t stop;
+  size_t shared;
+  size_t bytes;
+  str_buffer_t **lines;
+  size_t num_lines;
+  size_t lines_size;
+};
+
+struct PIECETable {
+  Arena *arena;
+  const char32_t *original;
+  size_t original_length;
+  map_file_t *mapped;
+  char32_t *added;
+  size_t added_length;
+  size_t added_size;
+  piece_node_t *root;
+  uint32_t seed;
 };
 
 struct ADDRBuffer {
@@ -42,7 +144,8 @@ regexp_buffer_t *regexp_buffer_create(const char32_t *patt1,
                                       const char32_t *patt2,
                                       const char32_t *replc,
                                       command_t *action) {
-  regexp_buffer_t *buffer = request_memory(sizeof(regexp_buffer_t));
+  regexp_buffer_t *buffer =
+      request_memory(current_arena, sizeof(regexp_buffer_t));
 
   if (buffer == NULL)
     raise("Region allocation error");
@@ -55,7 +158,7 @@ regexp_buffer_t *regexp_buffer_create(const char32_t *patt1,
 
 addr_buffer_t *addr_buffer_create(enum ADDRKind kind, ssize_t start,
                                   ssize_t end) {
-  addr_buffer_t *buffer = request_memory(sizeof(addr_buffer_t));
+  addr_buffer_t *buffer = request_memory(current_arena, sizeof(addr_buffer_t));
 
   if (buffer == NULL)
     raise("Region allocation error");
@@ -66,108 +169,1723 @@ addr_buffer_t *addr_buffer_create(enum ADDRKind kind, ssize_t start,
   return buffer;
 }
 
+static inline uint8_t *gap_buffer_at(gap_buffer_t *buffer, size_t phys) {
+  return &buffer->contents[phys * buffer->width];
+}
+
+static inline char32_t gap_buffer_get(gap_buffer_t *buffer, size_t phys) {
+  switch (buffer->width) {
+  case sizeof(uint8_t):
+    return buffer->contents[phys];
+  case sizeof(uint16_t):
+    return ((uint16_t *)buffer->contents)[phys];
+  default:
+    return ((char32_t *)buffer->contents)[phys];
+  }
+}
+
+static inline void gap_buffer_put(gap_buffer_t *buffer, size_t phys,
+                                  char32_t chr) {
+  switch (buffer->width) {
+  case sizeof(uint8_t):
+    buffer->contents[phys] = chr;
+    break;
+  case sizeof(uint16_t):
+    ((uint16_t *)buffer->contents)[phys] = chr;
+    break;
+  default:
+    ((char32_t *)buffer->contents)[phys] = chr;
+    break;
+  }
+}
+
+static unsigned gap_width_of(char32_t chr) {
+  if (chr <= 0xFF)
+    return sizeof(uint8_t);
+  if (chr <= 0xFFFF)
+    return sizeof(uint16_t);
+  return sizeof(char32_t);
+}
+
+static size_t gap_count_newlines(gap_buffer_t *buffer, size_t phys,
+                                 size_t count) {
+  const uint8_t *bytes = gap_buffer_at(buffer, phys);
+  unsigned width = buffer->width;
+  size_t i = 0, bits = 0;
+
+  // A matching lane sets one mask bit per byte of its width.
+#if defined(__AVX2__)
+  __m256i newline = width == sizeof(uint8_t)    ? _mm256_set1_epi8('\n')
+                    : width == sizeof(uint16_t) ? _mm256_set1_epi16('\n')
+                                                : _mm256_set1_epi32('\n');
+
+  for (; i + 32 / width <= count; i += 32 / width) {
+    __m256i block = _mm256_loadu_si256((const __m256i *)&bytes[i * width]);
+    __m256i hits = width == sizeof(uint8_t) ? _mm256_cmpeq_epi8(block, newline)
+                   : width == sizeof(uint16_t)
+                       ? _mm256_cmpeq_epi16(block, newline)
+                       : _mm256_cmpeq_epi32(block, newline);
+
+    bits += __builtin_popcount(_mm256_movemask_epi8(hits));
+  }
+#elif defined(__SSE2__)
+  __m128i newline = width == sizeof(uint8_t)    ? _mm_set1_epi8('\n')
+                    : width == sizeof(uint16_t) ? _mm_set1_epi16('\n')
+                                                : _mm_set1_epi32('\n');
+
+  for (; i + 16 / width <= count; i += 16 / width) {
+    __m128i block = _mm_loadu_si128((const __m128i *)&bytes[i * width]);
+    __m128i hits = width == sizeof(uint8_t) ? _mm_cmpeq_epi8(block, newline)
+                   : width == sizeof(uint16_t)
+                       ? _mm_cmpeq_epi16(block, newline)
+                       : _mm_cmpeq_epi32(block, newline);
+
+    bits += __builtin_popcount(_mm_movemask_epi8(hits));
+  }
+#endif
+
+  size_t found = bits / width;
+
+  for (; i < count; i++)
+    if (gap_buffer_get(buffer, phys + i) == U'\n')
+      found++;
+
+  return found;
+}
+
+static void gap_index_add(gap_buffer_t *buffer, size_t phys, ssize_t delta) {
+  size_t blocks = buffer->index_blocks;
+
+  if (buffer->index_deferred) {
+    buffer->index_stale = true;
+    return;
+  }
+
+  for (size_t i = (phys >> GAP_INDEX_BLOCK_SHIFT) + 1; i <= blocks; i += i & -i)
+    buffer->line_index[i] += delta;
+}
+
+static size_t gap_index_block_take(size_t phys, size_t end) {
+  size_t block_end = ((phys >> GAP_INDEX_BLOCK_SHIFT) + 1)
+                     << GAP_INDEX_BLOCK_SHIFT;
+
+  return (block_end < end ? block_end : end) - phys;
+}
+
+// Spans are counted a block at a time, so a long cursor move costs one
+// vector count and at most one index update per block it crosses.
+static void gap_index_span(gap_buffer_t *buffer, size_t phys, size_t count,
+                           ssize_t delta) {
+  if (buffer->index_deferred) {
+    buffer->index_stale = true;
+    return;
+  }
+
+  for (size_t end = phys + count; phys < end;) {
+    size_t take = gap_index_block_take(phys, end);
+    size_t found = gap_count_newlines(buffer, phys, take);
+
+    if (found > 0)
+      gap_index_add(buffer, phys, delta * (ssize_t)found);
+
+    phys += take;
+  }
+}
+
+static void gap_index_count(gap_buffer_t *buffer, size_t *index, size_t phys,
+                            size_t end) {
+  while (phys < end) {
+    size_t take = gap_index_block_take(phys, end);
+
+    index[(phys >> GAP_INDEX_BLOCK_SHIFT) + 1] +=
+        gap_count_newlines(buffer, phys, take);
+    phys += take;
+  }
+}
+
+static size_t gap_index_prefix(gap_buffer_t *buffer, size_t blocks) {
+  size_t sum = 0;
+
+  for (size_t i = blocks; i > 0; i -= i & -i)
+    sum += buffer->line_index[i];
+
+  return sum;
+}
+
+static void gap_index_rebuild(gap_buffer_t *buffer) {
+  size_t blocks = (buffer->contents_size + GAP_INDEX_BLOCK_SIZE - 1) >>
+                  GAP_INDEX_BLOCK_SHIFT;
+  size_t *index =
+      request_memory(buffer->arena, (blocks + 1) * sizeof(size_t));
+
+  if (index == NULL)
+    raise("Region allocation error");
+
+  memset(index, 0, (blocks + 1) * sizeof(size_t));
+  gap_index_count(buffer, index, 0, buffer->gap_start);
+  gap_index_count(buffer, index, buffer->gap_end, buffer->contents_size);
+
+  for (size_t i = 1; i <= blocks; i++) {
+    size_t parent = i + (i & -i);
+    if (parent <= blocks)
+      index[parent] += index[i];
+  }
+
+  if (buffer->line_index != NULL)
+    arena_recycle(buffer->arena, buffer->line_index,
+                  (buffer->index_blocks + 1) * sizeof(size_t));
+
+  buffer->line_index = index;
+  buffer->index_blocks = blocks;
+  buffer->index_stale = false;
+}
+
+static void gap_index_sync(gap_buffer_t *buffer) {
+  if (buffer->index_stale)
+    gap_index_rebuild(buffer);
+}
+
+// While deferred, edits only mark the line index stale and it is rebuilt
+// once, by the first lookup or when the batch is committed.
+void gap_buffer_defer_index(gap_buffer_t *buffer) {
+  buffer->index_deferred = true;
+}
+
+void gap_buffer_commit_index(gap_buffer_t *buffer) {
+  buffer->index_deferred = false;
+  gap_index_sync(buffer);
+}
+
+// Contents shared with a clone are counted, and whoever writes to them
+// first takes a private copy so the other side keeps the text it saw.
+static void gap_buffer_unshare(gap_buffer_t *buffer) {
+  if (buffer->contents_refs == NULL)
+    return;
+
+  if (*buffer->contents_refs == 1) {
+    arena_recycle(buffer->arena, buffer->contents_refs, sizeof(size_t));
+    buffer->contents_refs = NULL;
+    return;
+  }
+
+  uint8_t *contents =
+      request_memory(buffer->arena, buffer->contents_size * buffer->width);
+
+  if (contents == NULL)
+    raise("Region allocation error");
+
+  memcpy(contents, buffer->contents, buffer->gap_start * buffer->width);
+  memcpy(&contents[buffer->gap_end * buffer->width],
+         gap_buffer_at(buffer, buffer->gap_end),
+         (buffer->contents_size - buffer->gap_end) * buffer->width);
+
+  (*buffer->contents_refs)--;
+  buffer->contents = contents;
+  buffer->contents_refs = NULL;
+}
+
+static void gap_buffer_drop_contents(gap_buffer_t *buffer) {
+  if (buffer->contents_refs != NULL) {
+    if (--*buffer->contents_refs > 0) {
+      buffer->contents_refs = NULL;
+      return;
+    }
+
+    arena_recycle(buffer->arena, buffer->contents_refs, sizeof(size_t));
+    buffer->contents_refs = NULL;
+  }
+
+  arena_recycle(buffer->arena, buffer->contents,
+                buffer->contents_size * buffer->width);
+}
+
 gap_buffer_t *gap_buffer_create(size_t initial_size) {
-  gap_buffer_t *buffer = request_memory(sizeof(gap_buffer_t));
+  gap_buffer_t *buffer = request_memory(current_arena, sizeof(gap_buffer_t));
 
   if (buffer == NULL)
     raise("Region allocation error");
 
-  buffer->contents = request_memory(initial_size * sizeof(char32_t));
+  // The buffer remembers its arena so that contents it outgrows go back to
+  // the same region, whichever tab happens to be active at the time.
+  buffer->arena = current_arena;
+  // Text starts out as Latin-1 and is widened to UCS-2 or UCS-4 the first
+  // time a code point that does not fit is inserted.
+  buffer->contents =
+      request_memory(buffer->arena, initial_size * sizeof(uint8_t));
 
   if (buffer->contents == NULL)
     raise("Region allocation error");
 
+  buffer->contents_refs = NULL;
   buffer->contents_size = initial_size;
+  buffer->width = sizeof(uint8_t);
   buffer->gap_start = 0;
   buffer->gap_end = initial_size;
+  buffer->line_index = NULL;
+  buffer->index_blocks = 0;
+  buffer->index_deferred = false;
+  gap_index_rebuild(buffer);
 
   return buffer;
 }
 
+size_t gap_buffer_length(gap_buffer_t *buffer) {
+  return buffer->gap_start + (buffer->contents_size - buffer->gap_end);
+}
+
+static void gap_buffer_resize(gap_buffer_t *buffer, size_t new_size,
+                              unsigned width) {
+  uint8_t *new_contents = request_memory(buffer->arena, new_size * width);
+
+  if (new_contents == NULL)
+    raise("Region allocation error");
+
+  size_t contents_after_len = buffer->contents_size - buffer->gap_end;
+  size_t new_gap_end = new_size - contents_after_len;
+
+  if (width == buffer->width) {
+    memcpy(new_contents, buffer->contents, buffer->gap_start * width);
+    memcpy(&new_contents[new_gap_end * width],
+           gap_buffer_at(buffer, buffer->gap_end), contents_after_len * width);
+  } else {
+    gap_buffer_t wide = {.contents = new_contents, .width = width};
+
+    for (size_t i = 0; i < buffer->gap_start; i++)
+      gap_buffer_put(&wide, i, gap_buffer_get(buffer, i));
+    for (size_t i = 0; i < contents_after_len; i++)
+      gap_buffer_put(&wide, new_gap_end + i,
+                     gap_buffer_get(buffer, buffer->gap_end + i));
+  }
+
+  gap_buffer_drop_contents(buffer);
+
+  buffer->contents = new_contents;
+  buffer->gap_end = new_gap_end;
+  buffer->contents_size = new_size;
+  buffer->width = width;
+  gap_index_rebuild(buffer);
+}
+
+int gap_buffer_widen(gap_buffer_t *buffer, unsigned width) {
+  if (width > buffer->width)
+    gap_buffer_resize(buffer, buffer->contents_size, width);
+
+  return 1;
+}
+
+int gap_buffer_reserve(gap_buffer_t *buffer, size_t needed) {
+  size_t gap_size = buffer->gap_end - buffer->gap_start;
+
+  if (gap_size >= needed)
+    return 1;
+
+  // Grow once for the whole pending insert, but at least geometrically so
+  // a run of small inserts stays amortized O(1).
+  size_t new_size = buffer->contents_size * 2;
+  size_t required = buffer->contents_size - gap_size + needed;
+
+  if (new_size < required)
+    new_size = required;
+  if (new_size < GAP_BUFFER_MIN_GROWTH)
+    new_size = GAP_BUFFER_MIN_GROWTH;
+
+  gap_buffer_resize(buffer, new_size, buffer->width);
+  return 1;
+}
+
+int gap_buffer_expand(gap_buffer_t *buffer) {
+  return gap_buffer_reserve(buffer, buffer->gap_end - buffer->gap_start + 1);
+}
+
 int gap_buffer_insert(gap_buffer_t *buffer, char32_t chr) {
-  if (buffer->start == buffer->end)
-    if (!(buffer = gap_buffer_expand(buffer)))
+  if (!gap_buffer_widen(buffer, gap_width_of(chr)))
+    return 0;
+
+  if (buffer->gap_start == buffer->gap_end)
+    if (!gap_buffer_reserve(buffer, 1))
       return 0;
 
-  buffer->contents[buffer->gap_start++] = chr;
+  gap_buffer_unshare(buffer);
+
+  if (chr == U'\n')
+    gap_index_add(buffer, buffer->gap_start, 1);
+
+  gap_buffer_put(buffer, buffer->gap_start++, chr);
+  return 1;
+}
+
+int gap_buffer_insert_span(gap_buffer_t *buffer, const char32_t *span,
+                           size_t length) {
+  unsigned width = buffer->width;
+
+  for (size_t i = 0; i < length && width < sizeof(char32_t); i++)
+    if (gap_width_of(span[i]) > width)
+      width = gap_width_of(span[i]);
+
+  if (!gap_buffer_widen(buffer, width) || !gap_buffer_reserve(buffer, length))
+    return 0;
+
+  gap_buffer_unshare(buffer);
+
+  if (buffer->width == sizeof(char32_t))
+    memcpy(gap_buffer_at(buffer, buffer->gap_start), span,
+           length * sizeof(char32_t));
+  else
+    for (size_t i = 0; i < length; i++)
+      gap_buffer_put(buffer, buffer->gap_start + i, span[i]);
+
+  gap_index_span(buffer, buffer->gap_start, length, 1);
+  buffer->gap_start += length;
   return 1;
 }
 
 int gap_buffer_backspace(gap_buffer_t *buffer) {
   if (buffer->gap_start == 0)
     return 0;
-  buffer->gap_start--;
+  gap_index_span(buffer, --buffer->gap_start, 1, -1);
   return 1;
 }
 
 int gap_buffer_delete(gap_buffer_t *buffer) {
-  if (buffer->gap_end == gap->contents_size)
+  if (buffer->gap_end == buffer->contents_size)
     return 0;
-  buffer->gap_end++;
+  gap_index_span(buffer, buffer->gap_end++, 1, -1);
   return 1;
 }
 
 int gap_buffer_move_cursor(gap_buffer_t *buffer, size_t pos) {
-  size_t length = gap_buffer_length(buffer);
+  if (pos > gap_buffer_length(buffer))
+    return 0;
+
+  if (pos != buffer->gap_start)
+    gap_buffer_unshare(buffer);
+
+  if (pos > buffer->gap_start) {
+    size_t count = pos - buffer->gap_start;
+
+    gap_index_span(buffer, buffer->gap_end, count, -1);
+    memmove(gap_buffer_at(buffer, buffer->gap_start),
+            gap_buffer_at(buffer, buffer->gap_end), count * buffer->width);
+    gap_index_span(buffer, buffer->gap_start, count, 1);
+    buffer->gap_start += count;
+    buffer->gap_end += count;
+  } else if (pos < buffer->gap_start) {
+    size_t count = buffer->gap_start - pos;
+
+    gap_index_span(buffer, pos, count, -1);
+    memmove(gap_buffer_at(buffer, buffer->gap_end - count),
+            gap_buffer_at(buffer, pos), count * buffer->width);
+    gap_index_span(buffer, buffer->gap_end - count, count, 1);
+    buffer->gap_start -= count;
+    buffer->gap_end -= count;
+  }
 
-  if (pos > length)
+  return 1;
+}
+
+int gap_buffer_delete_range(gap_buffer_t *buffer, size_t start, size_t end) {
+  if (start > end || end > gap_buffer_length(buffer))
     return 0;
 
-  ssize_t delta = pos - buffer->gap_start;
-  if (delta > 0) {
-    while (delta-- > 0) {
-      if (buffer->gap_end >= buffer->contents_size)
-        return 0;
-      buffer->contents[buffer->gap_start++] =
-          buffer->contents[buffer->gap_end++];
-    }
-    else if (delta < 0) {
-      while (delta++ < 0) {
-        if (buffer->gap_start <= 0)
-          return 0;
-        buffer->contents[--buffer->gap_end] =
-            buffer->contents[--buffer->gap_start];
-      }
+  if (!gap_buffer_move_cursor(buffer, start))
+    return 0;
+
+  gap_index_span(buffer, buffer->gap_end, end - start, -1);
+  buffer->gap_end += end - start;
+  return 1;
+}
+
+size_t gap_buffer_line_count(gap_buffer_t *buffer) {
+  gap_index_sync(buffer);
+  return gap_index_prefix(buffer, buffer->index_blocks) + 1;
+}
+
+size_t gap_buffer_line_of(gap_buffer_t *buffer, size_t pos) {
+  size_t gap_size = buffer->gap_end - buffer->gap_start;
+  size_t phys = pos < buffer->gap_start ? pos : pos + gap_size;
+  size_t block_start = phys & ~(size_t)(GAP_INDEX_BLOCK_SIZE - 1);
+
+  gap_index_sync(buffer);
+
+  size_t line_no = gap_index_prefix(buffer, phys >> GAP_INDEX_BLOCK_SHIFT);
+
+  for (size_t i = block_start; i < phys; i++) {
+    if (i >= buffer->gap_start && i < buffer->gap_end)
+      i = buffer->gap_end;
+    if (i < phys && gap_buffer_get(buffer, i) == U'\n')
+      line_no++;
+  }
+
+  return line_no;
+}
+
+bool gap_buffer_line_start(gap_buffer_t *buffer, size_t line_no,
+                           size_t *pos) {
+  if (line_no == 0) {
+    *pos = 0;
+    return true;
+  }
+
+  if (line_no >= gap_buffer_line_count(buffer))
+    return false;
+
+  // Descend the tree to the block holding the newline that ends line
+  // line_no - 1, then scan that block for it.
+  size_t block = 0;
+  size_t remaining = line_no;
+  size_t step = 1;
+
+  while (step * 2 <= buffer->index_blocks)
+    step *= 2;
+
+  for (; step > 0; step /= 2) {
+    if (block + step <= buffer->index_blocks &&
+        buffer->line_index[block + step] < remaining) {
+      block += step;
+      remaining -= buffer->line_index[block];
     }
   }
 
-  return 1;
+  size_t phys = block << GAP_INDEX_BLOCK_SHIFT;
+  size_t limit = phys + GAP_INDEX_BLOCK_SIZE;
+
+  if (limit > buffer->contents_size)
+    limit = buffer->contents_size;
+
+  for (; phys < limit; phys++) {
+    if (phys >= buffer->gap_start && phys < buffer->gap_end)
+      phys = buffer->gap_end;
+    if (phys < limit && gap_buffer_get(buffer, phys) == U'\n' &&
+        --remaining == 0)
+      break;
+  }
+
+  if (phys >= buffer->gap_end)
+    phys -= buffer->gap_end - buffer->gap_start;
+
+  *pos = phys + 1;
+  return true;
 }
 
-int gap_buffer_expand(gap_buffer_t *buffer) {
-  size_t new_size = buffer->contents_size * 2;
-  if (new_size == 0)
-    new_size = 1;
+bool gap_buffer_resolve_addr(gap_buffer_t *buffer, addr_buffer_t *addr,
+                             size_t *start, size_t *end) {
+  size_t num_lines = gap_buffer_line_count(buffer);
+  size_t current = gap_buffer_line_of(buffer, buffer->gap_start);
+  ssize_t first, last;
+
+  switch (addr->kind) {
+  case ADDR_Abs:
+    first = last = addr->start;
+    break;
+  case ADDR_Rel:
+    first = last = (ssize_t)current + addr->start;
+    break;
+  case ADDR_Range:
+    first = addr->start;
+    last = addr->end;
+    break;
+  case ADDR_Start:
+    first = last = 0;
+    break;
+  case ADDR_End:
+    first = last = num_lines - 1;
+    break;
+  case ADDR_PrevLn:
+    first = last = (ssize_t)current - 1;
+    break;
+  case ADDR_NextLn:
+    first = last = current + 1;
+    break;
+  default:
+    return false;
+  }
 
-  char32_t *new_contents = request_memory(new_size * sizeof(char32_t));
+  if (first < 0 || last < first || (size_t)last >= num_lines)
+    return false;
 
-  if (new_contents == NULL)
+  if (!gap_buffer_line_start(buffer, first, start))
+    return false;
+  if (!gap_buffer_line_start(buffer, last + 1, end))
+    *end = gap_buffer_length(buffer);
+
+  return true;
+}
+
+char32_t *gap_buffer_retrieve_contents(gap_buffer_t *buffer) {
+  size_t length = gap_buffer_length(buffer);
+  char32_t *extract =
+      request_memory(current_arena, (length + 1) * sizeof(char32_t));
+
+  if (extract == NULL)
     raise("Region allocation error");
 
-  size_t contents_after_len = buffer->contents_size - buffer->gap_end;
+  for (size_t i = 0; i < buffer->gap_start; i++)
+    extract[i] = gap_buffer_get(buffer, i);
+  for (size_t i = buffer->gap_end; i < buffer->contents_size; i++)
+    extract[i - buffer->gap_end + buffer->gap_start] =
+        gap_buffer_get(buffer, i);
 
-  memmove(new_contents, buffer->contents, buffer->gap_start);
-  memmove(&new_contents[new_size - contents_after_len],
-          &buffer->contents[buffer->gap_end], contents_after_len);
+  extract[length] = U'\0';
 
-  buffer->contents = new_contents;
-  buffer->gap_end = new_size - contents_after_len;
-  buffer->contents_size = new_size;
+  return extract;
+}
 
-  return 1;
+void gap_buffer_copy_out(gap_buffer_t *buffer, size_t pos, size_t length,
+                         char32_t *out) {
+  size_t gap_size = buffer->gap_end - buffer->gap_start;
+
+  for (size_t i = 0; i < length; i++, pos++)
+    out[i] = gap_buffer_get(buffer, pos < buffer->gap_start ? pos
+                                                            : pos + gap_size);
 }
 
-size_t gap_buffer_length(gap_buffer_t *buffer) {
-  return buffer->start + (buffer->contents_size - buffer->end);
+// A clone shares the contents block until either side writes to it, so a
+// background writer can hold the text as it was without copying it up front.
+gap_buffer_t *gap_buffer_clone(gap_buffer_t *buffer) {
+  gap_buffer_t *clone = request_memory(buffer->arena, sizeof(gap_buffer_t));
+
+  if (clone == NULL)
+    raise("Region allocation error");
+
+  if (buffer->contents_refs == NULL) {
+    buffer->contents_refs = request_memory(buffer->arena, sizeof(size_t));
+
+    if (buffer->contents_refs == NULL)
+      raise("Region allocation error");
+
+    *buffer->contents_refs = 1;
+  }
+
+  *clone = *buffer;
+  (*clone->contents_refs)++;
+  clone->line_index = NULL;
+  clone->index_blocks = 0;
+  clone->index_deferred = false;
+  clone->index_stale = true;
+  return clone;
 }
 
-char32_t *gap_buffer_retrieve_contents(gab_buffer_t *buffer) {
-  size_t length = gab_buffer_length(buffer);
-  char32_t *extract = request_memory(length + 1);
+void gap_buffer_free(gap_buffer_t *buffer) {
+  gap_buffer_drop_contents(buffer);
 
-  memmove(extract, buffer->contents, buffer->gap_start);
-  memmove(&extract[buffer->gap_start], buffer->contents + buffer->gap_end,
-          buffer->content_size - buffer->gap_end);
+  if (buffer->line_index != NULL)
+    arena_recycle(buffer->arena, buffer->line_index,
+                  (buffer->index_blocks + 1) * sizeof(size_t));
 
-  return extract;
+  arena_recycle(buffer->arena, buffer, sizeof(gap_buffer_t));
+}
+
+// The descriptor is closed before raising, keeping errno for the report.
+static void map_file_fail(int fd, const char *call, const char *message) {
+  int error = errno;
+
+  close(fd);
+  errno = error;
+
+  if (call != NULL)
+    errno_raise(call);
+
+  raise(message);
+}
+
+map_file_t *map_file_open(Arena *arena, const char *path) {
+  int fd = open(path, O_RDONLY);
+
+  if (fd < 0)
+    errno_raise("open");
+
+  struct stat info;
+
+  if (fstat(fd, &info) != 0)
+    map_file_fail(fd, "fstat", NULL);
+
+  if (info.st_size % sizeof(char32_t) != 0)
+    map_file_fail(fd, NULL, "Truncated UTF-32 file");
+
+  map_file_t *map = request_memory(arena, sizeof(map_file_t));
+
+  if (map == NULL)
+    map_file_fail(fd, NULL, "Region allocation error");
+
+  map->arena = arena;
+  map->mapping = NULL;
+  map->mapping_size = info.st_size;
+
+  if (map->mapping_size > 0) {
+    map->mapping = mmap(NULL, map->mapping_size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+    if (map->mapping == MAP_FAILED)
+      map_file_fail(fd, "mmap", NULL);
+  }
+
+  close(fd);
+
+  map->text = map->mapping;
+  map->length = map->mapping_size / sizeof(char32_t);
+  map->swapped = false;
+
+  if (map->length > 0 &&
+      (map->text[0] == 0x0000FEFF || map->text[0] == 0xFFFE0000)) {
+    map->swapped = map->text[0] == 0xFFFE0000;
+    map->text++;
+    map->length--;
+  }
+
+  // Chunks are validated, byte-swapped and line-counted only when first
+  // touched, so opening a file costs nothing beyond the mapping itself.
+  map->num_chunks = (map->length + MAP_CHUNK_CHARS - 1) / MAP_CHUNK_CHARS;
+  map->chunks =
+      request_memory(map->arena, map->num_chunks * sizeof(char32_t *));
+  map->line_counts =
+      request_memory(map->arena, map->num_chunks * sizeof(size_t));
+
+  if (map->chunks == NULL || map->line_counts == NULL)
+    raise("Region allocation error");
+
+  memset(map->chunks, 0, map->num_chunks * sizeof(char32_t *));
+  memset(map->line_counts, 0xFF, map->num_chunks * sizeof(size_t));
+
+  return map;
+}
+
+void map_file_close(map_file_t *map) {
+  if (map->mapping != NULL)
+    munmap(map->mapping, map->mapping_size);
+
+  map->mapping = NULL;
+  map->text = NULL;
+  map->length = 0;
+}
+
+static size_t map_chunk_length(map_file_t *map, size_t chunk) {
+  size_t start = chunk * MAP_CHUNK_CHARS;
+  return map->length - start < MAP_CHUNK_CHARS ? map->length - start
+                                                : MAP_CHUNK_CHARS;
+}
+
+static const char32_t *map_file_chunk(map_file_t *map, size_t chunk) {
+  if (map->chunks[chunk] != NULL)
+    return map->chunks[chunk];
+
+  const char32_t *source = &map->text[chunk * MAP_CHUNK_CHARS];
+  size_t length = map_chunk_length(map, chunk);
+
+  if (map->swapped) {
+    char32_t *swapped = request_memory(map->arena, length * sizeof(char32_t));
+
+    if (swapped == NULL)
+      raise("Region allocation error");
+
+    for (size_t i = 0; i < length; i++)
+      swapped[i] = __builtin_bswap32(source[i]);
+
+    source = swapped;
+  }
+
+  for (size_t i = 0; i < length; i++)
+    if (source[i] > 0x10FFFF || (source[i] >= 0xD800 && source[i] <= 0xDFFF))
+      raise("Invalid character input");
+
+  map->chunks[chunk] = source;
+  return source;
+}
+
+void map_file_copy(map_file_t *map, size_t offset, size_t length,
+                   char32_t *out) {
+  while (length > 0) {
+    size_t chunk = offset / MAP_CHUNK_CHARS;
+    size_t within = offset % MAP_CHUNK_CHARS;
+    size_t count = map_chunk_length(map, chunk) - within;
+
+    if (count > length)
+      count = length;
+
+    memcpy(out, &map_file_chunk(map, chunk)[within],
+           count * sizeof(char32_t));
+    out += count;
+    offset += count;
+    length -= count;
+  }
+}
+
+static size_t u32_find_line(const char32_t *text, size_t length,
+                            size_t *remaining) {
+  for (size_t at = u32_find_char(text, length, U'\n'); at < length;
+       at += 1 + u32_find_char(&text[at + 1], length - at - 1, U'\n'))
+    if (--*remaining == 0)
+      return at + 1;
+
+  return SIZE_MAX;
+}
+
+// A chunk's newlines are counted the first time a line lookup crosses it.
+static size_t map_chunk_newlines(map_file_t *map, size_t chunk) {
+  if (map->line_counts[chunk] != SIZE_MAX)
+    return map->line_counts[chunk];
+
+  const char32_t *text = map_file_chunk(map, chunk);
+  size_t length = map_chunk_length(map, chunk);
+  size_t count = 0;
+
+  for (size_t pos = u32_find_char(text, length, U'\n'); pos < length;
+       pos += 1 + u32_find_char(&text[pos + 1], length - pos - 1, U'\n'))
+    count++;
+
+  map->line_counts[chunk] = count;
+  return count;
+}
+
+// Returns the offset just past the remaining-th newline in the range, or
+// takes the range's newlines off remaining and returns SIZE_MAX. Whole
+// chunks are skipped by their counts, so only the chunk holding the line is
+// scanned.
+static size_t map_file_find_line(map_file_t *map, size_t offset,
+                                 size_t length, size_t *remaining) {
+  for (size_t done = 0; done < length;) {
+    size_t chunk = (offset + done) / MAP_CHUNK_CHARS;
+    size_t within = (offset + done) % MAP_CHUNK_CHARS;
+    size_t count = map_chunk_length(map, chunk) - within;
+
+    if (count > length - done)
+      count = length - done;
+
+    if (count == map_chunk_length(map, chunk) &&
+        map_chunk_newlines(map, chunk) < *remaining) {
+      *remaining -= map_chunk_newlines(map, chunk);
+    } else {
+      size_t at = u32_find_line(&map_file_chunk(map, chunk)[within], count,
+                                remaining);
+
+      if (at != SIZE_MAX)
+        return done + at;
+    }
+
+    done += count;
+  }
+
+  return SIZE_MAX;
+}
+
+static piece_node_t *piece_node_new(piece_table_t *table, bool in_added,
+                                    size_t offset, size_t length) {
+  piece_node_t *node = request_memory(table->arena, sizeof(piece_node_t));
+
+  if (node == NULL)
+    raise("Region allocation error");
+
+  table->seed ^= table->seed << 13;
+  table->seed ^= table->seed >> 17;
+  table->seed ^= table->seed << 5;
+
+  node->in_added = in_added;
+  node->offset = offset;
+  node->length = length;
+  node->subtree_length = length;
+  node->priority = table->seed;
+  node->left = NULL;
+  node->right = NULL;
+  return node;
+}
+
+static size_t piece_subtree_length(piece_node_t *node) {
+  return node == NULL ? 0 : node->subtree_length;
+}
+
+static void piece_node_update(piece_node_t *node) {
+  node->subtree_length = piece_subtree_length(node->left) + node->length +
+                         piece_subtree_length(node->right);
+}
+
+static piece_node_t *piece_merge(piece_node_t *left, piece_node_t *right) {
+  if (left == NULL)
+    return right;
+  if (right == NULL)
+    return left;
+
+  if (left->priority > right->priority) {
+    left->right = piece_merge(left->right, right);
+    piece_node_update(left);
+    return left;
+  }
+
+  right->left = piece_merge(left, right->left);
+  piece_node_update(right);
+  return right;
+}
+
+static void piece_free(piece_table_t *table, piece_node_t *node) {
+  if (node == NULL)
+    return;
+
+  piece_free(table, node->left);
+  piece_free(table, node->right);
+  arena_recycle(table->arena, node, sizeof(piece_node_t));
+}
+
+static void piece_split(piece_table_t *table, piece_node_t *node, size_t pos,
+                        piece_node_t **left, piece_node_t **right) {
+  if (node == NULL) {
+    *left = *right = NULL;
+    return;
+  }
+
+  size_t left_length = piece_subtree_length(node->left);
+
+  if (pos <= left_length) {
+    piece_split(table, node->left, pos, left, &node->left);
+    piece_node_update(node);
+    *right = node;
+  } else if (pos >= left_length + node->length) {
+    piece_split(table, node->right, pos - left_length - node->length,
+                &node->right, right);
+    piece_node_update(node);
+    *left = node;
+  } else {
+    // The split point falls inside this piece, so cut it in two and hang
+    // the tail off the right subtree. The tail takes over the piece's place
+    // above that subtree, so it keeps the piece's priority to stay a heap.
+    size_t head = pos - left_length;
+    piece_node_t *tail = piece_node_new(table, node->in_added,
+                                        node->offset + head,
+                                        node->length - head);
+
+    tail->priority = node->priority;
+    tail->right = node->right;
+    piece_node_update(tail);
+    node->length = head;
+    node->right = NULL;
+    piece_node_update(node);
+    *left = node;
+    *right = tail;
+  }
+}
+
+piece_table_t *piece_table_create(const char32_t *original, size_t length) {
+  piece_table_t *table = request_memory(current_arena, sizeof(piece_table_t));
+
+  if (table == NULL)
+    raise("Region allocation error");
+
+  table->arena = current_arena;
+  table->original = original;
+  table->original_length = length;
+  table->mapped = NULL;
+  table->added = NULL;
+  table->added_length = 0;
+  table->added_size = 0;
+  table->seed = 2463534242u;
+  table->root = length == 0 ? NULL : piece_node_new(table, false, 0, length);
+
+  return table;
+}
+
+// The mapping's chunk tables live as long as the piece table, so they come
+// from the table's arena rather than whichever tab happens to be active.
+piece_table_t *piece_table_open_mapped(const char *path) {
+  piece_table_t *table = piece_table_create(NULL, 0);
+  map_file_t *map = map_file_open(table->arena, path);
+
+  table->mapped = map;
+  table->original_length = map->length;
+  table->root = map->length == 0 ? NULL : piece_node_new(table, false, 0,
+                                                         map->length);
+  return table;
+}
+
+size_t piece_table_length(piece_table_t *table) {
+  return piece_subtree_length(table->root);
+}
+
+static int piece_table_append(piece_table_t *table, const char32_t *span,
+                              size_t length) {
+  if (table->added_length + length > table->added_size) {
+    size_t new_size = table->added_size * 2;
+
+    if (new_size < table->added_length + length)
+      new_size = table->added_length + length;
+    if (new_size < GAP_BUFFER_MIN_GROWTH)
+      new_size = GAP_BUFFER_MIN_GROWTH;
+
+    char32_t *added =
+        request_memory(table->arena, new_size * sizeof(char32_t));
+
+    if (added == NULL)
+      raise("Region allocation error");
+
+    if (table->added != NULL) {
+      memcpy(added, table->added, table->added_length * sizeof(char32_t));
+      arena_recycle(table->arena, table->added,
+                    table->added_size * sizeof(char32_t));
+    }
+    table->added = added;
+    table->added_size = new_size;
+  }
+
+  memcpy(&table->added[table->added_length], span, length * sizeof(char32_t));
+  table->added_length += length;
+  return 1;
+}
+
+int piece_table_insert(piece_table_t *table, size_t pos, const char32_t *span,
+                       size_t length) {
+  if (pos > piece_table_length(table))
+    return 0;
+  if (length == 0)
+    return 1;
+
+  size_t offset = table->added_length;
+  piece_node_t *left, *right;
+
+  if (!piece_table_append(table, span, length))
+    return 0;
+
+  piece_split(table, table->root, pos, &left, &right);
+
+  // Typing appends to the add buffer right after the previous insert, so
+  // extend that piece instead of growing the tree by one node per key.
+  piece_node_t *last = left;
+
+  while (last != NULL && last->right != NULL)
+    last = last->right;
+
+  if (last != NULL && last->in_added &&
+      last->offset + last->length == offset) {
+    for (piece_node_t *node = left; node != NULL; node = node->right)
+      node->subtree_length += length;
+    last->length += length;
+    table->root = piece_merge(left, right);
+    return 1;
+  }
+
+  piece_node_t *node = piece_node_new(table, true, offset, length);
+
+  table->root = piece_merge(piece_merge(left, node), right);
+  return 1;
+}
+
+int piece_table_delete(piece_table_t *table, size_t start, size_t end) {
+  if (start > end || end > piece_table_length(table))
+    return 0;
+
+  piece_node_t *left, *middle, *right;
+
+  piece_split(table, table->root, start, &left, &middle);
+  piece_split(table, middle, end - start, &middle, &right);
+  piece_free(table, middle);
+  table->root = piece_merge(left, right);
+  return 1;
+}
+
+static char32_t *piece_copy_out(piece_table_t *table, piece_node_t *node,
+                                char32_t *out) {
+  if (node == NULL)
+    return out;
+
+  out = piece_copy_out(table, node->left, out);
+
+  if (!node->in_added && table->mapped != NULL) {
+    map_file_copy(table->mapped, node->offset, node->length, out);
+  } else {
+    const char32_t *source = node->in_added ? table->added : table->original;
+
+    memcpy(out, &source[node->offset], node->length * sizeof(char32_t));
+  }
+
+  return piece_copy_out(table, node->right, out + node->length);
+}
+
+static size_t piece_find_line(piece_table_t *table, piece_node_t *node,
+                              size_t *remaining) {
+  if (node == NULL)
+    return SIZE_MAX;
+
+  size_t at = piece_find_line(table, node->left, remaining);
+
+  if (at != SIZE_MAX)
+    return at;
+
+  size_t before = piece_subtree_length(node->left);
+
+  if (!node->in_added && table->mapped != NULL) {
+    at = map_file_find_line(table->mapped, node->offset, node->length,
+                            remaining);
+  } else {
+    const char32_t *source = node->in_added ? table->added : table->original;
+
+    at = u32_find_line(&source[node->offset], node->length, remaining);
+  }
+
+  if (at != SIZE_MAX)
+    return before + at;
+
+  at = piece_find_line(table, node->right, remaining);
+  return at == SIZE_MAX ? SIZE_MAX : before + node->length + at;
+}
+
+// Pieces are walked in order, so the lookup holds in the table's current
+// coordinates however it has been edited. Original text of a mapped file is
+// counted a chunk at a time, and added text is scanned.
+bool piece_table_line_start(piece_table_t *table, size_t line_no,
+                            size_t *pos) {
+  size_t remaining = line_no;
+
+  if (line_no == 0) {
+    *pos = 0;
+    return true;
+  }
+
+  size_t at = piece_find_line(table, table->root, &remaining);
+
+  if (at == SIZE_MAX)
+    return false;
+
+  *pos = at;
+  return true;
+}
+
+char32_t *piece_table_retrieve_contents(piece_table_t *table) {
+  size_t length = piece_table_length(table);
+  char32_t *extract =
+      request_memory(current_arena, (length + 1) * sizeof(char32_t));
+
+  if (extract == NULL)
+    raise("Region allocation error");
+
+  piece_copy_out(table, table->root, extract);
+  extract[length] = U'\0';
+  return extract;
+}
+
+static txt_node_t *txt_node_new(txt_buffer_t *buffer, bool is_leaf) {
+  txt_node_t *node = request_memory(buffer->arena, sizeof(txt_node_t));
+
+  if (node == NULL)
+    raise("Region allocation error");
+
+  node->is_leaf = is_leaf;
+  node->refs = 1;
+  node->num_entries = 0;
+  node->num_lines = 0;
+  node->mark = 0;
+  return node;
+}
+
+static void txt_node_release(txt_buffer_t *buffer, txt_node_t *node) {
+  if (--node->refs > 0)
+    return;
+
+  if (!node->is_leaf)
+    for (size_t i = 0; i < node->num_entries; i++)
+      txt_node_release(buffer, node->children[i]);
+
+  arena_recycle(buffer->arena, node, sizeof(txt_node_t));
+}
+
+// Nodes reachable from a snapshot are shared, so a node is copied before
+// it is written if anything else still holds it. An edit therefore copies
+// only the path from the root to the lines it touches.
+static txt_node_t *txt_node_unshare(txt_buffer_t *buffer, txt_node_t **slot) {
+  txt_node_t *node = *slot;
+
+  if (node->refs == 1)
+    return node;
+
+  txt_node_t *copy = txt_node_new(buffer, node->is_leaf);
+
+  memcpy(copy->children, node->children,
+         node->num_entries * sizeof(txt_node_t *));
+  copy->num_entries = node->num_entries;
+  copy->num_lines = node->num_lines;
+
+  if (!node->is_leaf)
+    for (size_t i = 0; i < node->num_entries; i++)
+      node->children[i]->refs++;
+
+  node->refs--;
+  *slot = copy;
+  return copy;
+}
+
+txt_buffer_t *txt_buffer_new_blank(void) {
+  txt_buffer_t *buffer = request_memory(current_arena, sizeof(txt_buffer_t));
+
+  if (buffer == NULL)
+    raise("Region allocation error");
+
+  buffer->arena = current_arena;
+  buffer->num_lines = 0;
+  buffer->root = txt_node_new(buffer, true);
+  return buffer;
+}
+
+static size_t txt_node_span_lines(txt_node_t *node, size_t from,
+                                  size_t count) {
+  if (node->is_leaf)
+    return count;
+
+  size_t lines = 0;
+
+  for (size_t i = from; i < from + count; i++)
+    lines += node->children[i]->num_lines;
+
+  return lines;
+}
+
+// Leaves and inner nodes share one pointer array, so entries are moved the
+// same way whichever kind of node they sit in.
+static void txt_node_move(txt_node_t *to, size_t at, txt_node_t *from,
+                          size_t start, size_t count) {
+  size_t lines = txt_node_span_lines(from, start, count);
+
+  memmove(&to->children[at + count], &to->children[at],
+          (to->num_entries - at) * sizeof(txt_node_t *));
+  memcpy(&to->children[at], &from->children[start],
+         count * sizeof(txt_node_t *));
+  memmove(&from->children[start], &from->children[start + count],
+          (from->num_entries - start - count) * sizeof(txt_node_t *));
+
+  to->num_entries += count;
+  to->num_lines += lines;
+  from->num_entries -= count;
+  from->num_lines -= lines;
+}
+
+static txt_node_t *txt_node_find_leaf(txt_node_t *node, size_t line_no,
+                                      size_t *slot) {
+  while (!node->is_leaf) {
+    size_t i = 0;
+
+    while (i + 1 < node->num_entries &&
+           line_no >= node->children[i]->num_lines)
+      line_no -= node->children[i++]->num_lines;
+
+    node = node->children[i];
+  }
+
+  *slot = line_no;
+  return node;
+}
+
+str_buffer_t **txt_buffer_at(txt_buffer_t *buffer, size_t line_no) {
+  txt_node_t *node = txt_node_unshare(buffer, &buffer->root);
+
+  while (!node->is_leaf) {
+    size_t i = 0;
+
+    while (i + 1 < node->num_entries &&
+           line_no >= node->children[i]->num_lines)
+      line_no -= node->children[i++]->num_lines;
+
+    node = txt_node_unshare(buffer, &node->children[i]);
+  }
+
+  return &node->lines[line_no];
+}
+
+str_buffer_t *txt_buffer_line(txt_buffer_t *buffer, size_t line_no) {
+  size_t slot;
+
+  if (line_no >= buffer->num_lines)
+    return NULL;
+
+  return txt_node_find_leaf(buffer->root, line_no, &slot)->lines[slot];
+}
+
+static txt_node_t *txt_node_insert(txt_buffer_t *buffer, txt_node_t *node,
+                                   size_t pos, str_buffer_t *line) {
+  if (node->is_leaf) {
+    memmove(&node->lines[pos + 1], &node->lines[pos],
+            (node->num_entries - pos) * sizeof(str_buffer_t *));
+    node->lines[pos] = line;
+    node->num_entries++;
+    node->num_lines++;
+  } else {
+    size_t i = 0;
+
+    while (i + 1 < node->num_entries && pos > node->children[i]->num_lines)
+      pos -= node->children[i++]->num_lines;
+
+    txt_node_t *child = txt_node_unshare(buffer, &node->children[i]);
+    txt_node_t *sibling = txt_node_insert(buffer, child, pos, line);
+
+    node->num_lines++;
+
+    if (sibling != NULL) {
+      memmove(&node->children[i + 2], &node->children[i + 1],
+              (node->num_entries - i - 1) * sizeof(txt_node_t *));
+      node->children[i + 1] = sibling;
+      node->num_entries++;
+    }
+  }
+
+  if (node->num_entries < TXT_NODE_MAX_ENTRIES)
+    return NULL;
+
+  // A full node splits in half and hands the upper half to its parent.
+  txt_node_t *split = txt_node_new(buffer, node->is_leaf);
+  size_t half = node->num_entries / 2;
+
+  txt_node_move(split, 0, node, half, node->num_entries - half);
+  return split;
+}
+
+int txt_buffer_insert_lines(txt_buffer_t *buffer, size_t pos,
+                            str_buffer_t **lines, size_t count) {
+  if (pos > buffer->num_lines)
+    return 0;
+
+  for (size_t i = 0; i < count; i++) {
+    txt_node_t *root = txt_node_unshare(buffer, &buffer->root);
+    txt_node_t *sibling = txt_node_insert(buffer, root, pos + i, lines[i]);
+
+    if (sibling != NULL) {
+      buffer->root = txt_node_new(buffer, false);
+      buffer->root->children[0] = root;
+      buffer->root->children[1] = sibling;
+      buffer->root->num_entries = 2;
+      buffer->root->num_lines = root->num_lines + sibling->num_lines;
+    }
+
+    buffer->num_lines++;
+  }
+
+  return 1;
+}
+
+txt_buffer_t *txt_buffer_insert_line(txt_buffer_t *buffer,
+                                     str_buffer_t *line) {
+  txt_buffer_insert_lines(buffer, buffer->num_lines, &line, 1);
+  return buffer;
+}
+
+static void txt_node_rebalance(txt_buffer_t *buffer, txt_node_t *node) {
+  size_t i = 0;
+
+  while (i < node->num_entries && node->num_entries > 1) {
+    if (node->children[i]->num_entries >= TXT_NODE_MIN_ENTRIES) {
+      i++;
+      continue;
+    }
+
+    size_t left = i + 1 < node->num_entries ? i : i - 1;
+    txt_node_t *a = txt_node_unshare(buffer, &node->children[left]);
+    txt_node_t *b = txt_node_unshare(buffer, &node->children[left + 1]);
+
+    if (a->num_entries + b->num_entries < TXT_NODE_MAX_ENTRIES) {
+      txt_node_move(a, a->num_entries, b, 0, b->num_entries);
+      txt_node_release(buffer, b);
+      memmove(&node->children[left + 1], &node->children[left + 2],
+              (node->num_entries - left - 2) * sizeof(txt_node_t *));
+      node->num_entries--;
+      i = left;
+      continue;
+    }
+
+    size_t target = (a->num_entries + b->num_entries) / 2;
+
+    if (a->num_entries > target)
+      txt_node_move(b, 0, a, target, a->num_entries - target);
+    else
+      txt_node_move(a, a->num_entries, b, 0, target - a->num_entries);
+
+    i = left + 1;
+  }
+}
+
+static void txt_node_delete(txt_buffer_t *buffer, txt_node_t *node,
+                            size_t start, size_t count) {
+  node->num_lines -= count;
+
+  if (node->is_leaf) {
+    memmove(&node->lines[start], &node->lines[start + count],
+            (node->num_entries - start - count) * sizeof(str_buffer_t *));
+    node->num_entries -= count;
+    return;
+  }
+
+  size_t end = start + count;
+  size_t offset = 0;
+  size_t kept = 0;
+
+  // Children wholly inside the range are unlinked without being visited,
+  // so only the two boundary paths are walked.
+  for (size_t i = 0; i < node->num_entries; i++) {
+    txt_node_t *child = node->children[i];
+    size_t child_lines = child->num_lines;
+    size_t from = start > offset ? start : offset;
+    size_t to = end < offset + child_lines ? end : offset + child_lines;
+
+    if (from >= to) {
+      node->children[kept++] = child;
+    } else if (to - from == child_lines) {
+      txt_node_release(buffer, child);
+    } else {
+      node->children[kept] = child;
+      child = txt_node_unshare(buffer, &node->children[kept++]);
+      txt_node_delete(buffer, child, from - offset, to - from);
+    }
+
+    offset += child_lines;
+  }
+
+  node->num_entries = kept;
+  txt_node_rebalance(buffer, node);
+}
+
+int txt_buffer_delete_lines(txt_buffer_t *buffer, size_t start,
+                            size_t count) {
+  if (start > buffer->num_lines || count > buffer->num_lines - start)
+    return 0;
+  if (count == 0)
+    return 1;
+
+  txt_node_delete(buffer, txt_node_unshare(buffer, &buffer->root), start,
+                  count);
+  buffer->num_lines -= count;
+
+  while (!buffer->root->is_leaf && buffer->root->num_entries <= 1) {
+    txt_node_t *root = txt_node_unshare(buffer, &buffer->root);
+
+    buffer->root = root->num_entries == 1 ? root->children[0]
+                                          : txt_node_new(buffer, true);
+    root->num_entries = 0;
+    txt_node_release(buffer, root);
+  }
+
+  return 1;
+}
+
+void txt_buffer_assign(txt_buffer_t *buffer, str_buffer_t **lines,
+                       size_t num_lines) {
+  size_t count =
+      (num_lines + TXT_NODE_FILL_ENTRIES - 1) / TXT_NODE_FILL_ENTRIES;
+  txt_node_t **level = malloc((count > 0 ? count : 1) * sizeof(txt_node_t *));
+
+  if (level == NULL)
+    raise("Memory allocation error");
+
+  txt_node_release(buffer, buffer->root);
+
+  if (count == 0)
+    level[0] = txt_node_new(buffer, true);
+
+  // Built bottom-up with leaves three quarters full, leaving room for the
+  // next inserts before anything has to split.
+  for (size_t i = 0, done = 0; i < count; i++) {
+    size_t take = (num_lines - done) / (count - i);
+    txt_node_t *leaf = txt_node_new(buffer, true);
+
+    memcpy(leaf->lines, &lines[done], take * sizeof(str_buffer_t *));
+    leaf->num_entries = take;
+    leaf->num_lines = take;
+    level[i] = leaf;
+    done += take;
+  }
+
+  while (count > 1) {
+    size_t parents =
+        (count + TXT_NODE_FILL_ENTRIES - 1) / TXT_NODE_FILL_ENTRIES;
+
+    for (size_t i = 0, done = 0; i < parents; i++) {
+      size_t take = (count - done) / (parents - i);
+      txt_node_t *node = txt_node_new(buffer, false);
+
+      memcpy(node->children, &level[done], take * sizeof(txt_node_t *));
+      node->num_entries = take;
+      node->num_lines = txt_node_span_lines(node, 0, take);
+      level[i] = node;
+      done += take;
+    }
+
+    count = parents;
+  }
+
+  buffer->root = level[0];
+  buffer->num_lines = num_lines;
+  free(level);
+}
+
+void txt_buffer_iter_init(txt_iter_t *iter, txt_buffer_t *buffer,
+                          size_t line_no) {
+  iter->buffer = buffer;
+  iter->leaf = NULL;
+  iter->slot = 0;
+  iter->line_no = line_no;
+}
+
+// Lines are handed out leaf by leaf, descending from the root only once per
+// leaf, so a full scan reads each leaf's pointer array front to back.
+str_buffer_t *txt_buffer_iter_next(txt_iter_t *iter) {
+  if (iter->line_no >= iter->buffer->num_lines)
+    return NULL;
+
+  if (iter->leaf == NULL || iter->slot >= iter->leaf->num_entries)
+    iter->leaf =
+        txt_node_find_leaf(iter->buffer->root, iter->line_no, &iter->slot);
+
+  iter->line_no++;
+  return iter->leaf->lines[iter->slot++];
+}
+
+// A clone shares every node with its source, so it costs O(1) and lets
+// checkpoints, other views and background writers hold a fixed version of
+// the text while editing carries on.
+txt_buffer_t *txt_buffer_clone(txt_buffer_t *buffer) {
+  txt_buffer_t *clone = request_memory(buffer->arena, sizeof(txt_buffer_t));
+
+  if (clone == NULL)
+    raise("Region allocation error");
+
+  clone->arena = buffer->arena;
+  clone->root = buffer->root;
+  clone->num_lines = buffer->num_lines;
+  clone->root->refs++;
+  return clone;
+}
+
+void txt_buffer_restore(txt_buffer_t *buffer, txt_buffer_t *snapshot) {
+  snapshot->root->refs++;
+  txt_node_release(buffer, buffer->root);
+  buffer->root = snapshot->root;
+  buffer->num_lines = snapshot->num_lines;
+}
+
+void txt_buffer_free(txt_buffer_t *buffer) {
+  txt_node_release(buffer, buffer->root);
+  arena_recycle(buffer->arena, buffer, sizeof(txt_buffer_t));
+}
+
+static size_t txt_mark_epoch;
+
+static void txt_node_mark(txt_node_t *node, size_t mark) {
+  node->mark = mark;
+
+  if (!node->is_leaf)
+    for (size_t i = 0; i < node->num_entries; i++)
+      txt_node_mark(node->children[i], mark);
+}
+
+// Collects the nodes of a tree down to the first node of each subtree marked
+// stop or shared, and marks where it stopped as shared. A node has one
+// parent within a tree, so a subtree both trees hold is always entered
+// through such a node.
+static void txt_node_diff(txt_node_t *node, txt_diff_t *diff) {
+  if (node->mark == diff->stop || node->mark == diff->shared) {
+    node->mark = diff->shared;
+    return;
+  }
+
+  diff->bytes += sizeof(txt_node_t);
+
+  if (!node->is_leaf) {
+    for (size_t i = 0; i < node->num_entries; i++)
+      txt_node_diff(node->children[i], diff);
+    return;
+  }
+
+  if (diff->num_lines + node->num_entries > diff->lines_size) {
+    size_t size = diff->lines_size * 2 + TXT_NODE_MAX_ENTRIES;
+    str_buffer_t **lines = realloc(diff->lines, size * sizeof(str_buffer_t *));
+
+    if (lines == NULL)
+      raise("Memory allocation error");
+
+    diff->lines = lines;
+    diff->lines_size = size;
+  }
+
+  memcpy(&diff->lines[diff->num_lines], node->lines,
+         node->num_entries * sizeof(str_buffer_t *));
+  diff->num_lines += node->num_entries;
+}
+
+static int txt_line_compare(const void *a, const void *b) {
+  uintptr_t line_a = (uintptr_t)*(str_buffer_t *const *)a;
+  uintptr_t line_b = (uintptr_t)*(str_buffer_t *const *)b;
+  return (line_a > line_b) - (line_a < line_b);
+}
+
+// What buffer holds that newer, a later version of the same text, does not:
+// the nodes of its own and the lines no node of newer still points to. Only
+// the nodes the two do not share are ever looked at line by line.
+size_t txt_buffer_held_bytes(txt_buffer_t *buffer, txt_buffer_t *newer) {
+  txt_diff_t dropped = {0}, kept = {0};
+
+  dropped.stop = ++txt_mark_epoch;
+  dropped.shared = kept.stop = kept.shared = ++txt_mark_epoch;
+
+  txt_node_mark(newer->root, dropped.stop);
+  txt_node_diff(buffer->root, &dropped);
+  txt_node_diff(newer->root, &kept);
+
+  if (kept.num_lines > 0)
+    qsort(kept.lines, kept.num_lines, sizeof(str_buffer_t *),
+          txt_line_compare);
+
+  size_t bytes = sizeof(txt_buffer_t) + dropped.bytes;
+
+  for (size_t i = 0; i < dropped.num_lines; i++)
+    if (kept.num_lines == 0 ||
+        bsearch(&dropped.lines[i], kept.lines, kept.num_lines,
+                sizeof(str_buffer_t *), txt_line_compare) == NULL)
+      bytes += sizeof(str_buffer_t) +
+               dropped.lines[i]->size * sizeof(char32_t);
+
+  free(dropped.lines);
+  free(kept.lines);
+  return bytes;
+}
+
+int tab_buffer_insert(tab_buffer_t *tab, size_t pos, const char32_t *span,
+                      size_t length) {
+  switch (tab->storage) {
+  case STORAGE_GapBuffer:
+    return gap_buffer_move_cursor(tab->txt_buffer, pos) &&
+           gap_buffer_insert_span(tab->txt_buffer, span, length);
+  case STORAGE_PieceTable:
+    return piece_table_insert(tab->piece_table, pos, span, length);
+  default:
+    return 0;
+  }
+}
+
+int tab_buffer_delete(tab_buffer_t *tab, size_t start, size_t end) {
+  switch (tab->storage) {
+  case STORAGE_GapBuffer:
+    return gap_buffer_delete_range(tab->txt_buffer, start, end);
+  case STORAGE_PieceTable:
+    return piece_table_delete(tab->piece_table, start, end);
+  default:
+    return 0;
+  }
+}
+
+size_t tab_buffer_length(tab_buffer_t *tab) {
+  switch (tab->storage) {
+  case STORAGE_GapBuffer:
+    return gap_buffer_length(tab->txt_buffer);
+  case STORAGE_PieceTable:
+    return piece_table_length(tab->piece_table);
+  default:
+    return 0;
+  }
+}
+
+char32_t *tab_buffer_retrieve_contents(tab_buffer_t *tab) {
+  switch (tab->storage) {
+  case STORAGE_GapBuffer:
+    return gap_buffer_retrieve_contents(tab->txt_buffer);
+  case STORAGE_PieceTable:
+    return piece_table_retrieve_contents(tab->piece_table);
+  default:
+    return NULL;
+  }
+}
+
+bool tab_buffer_line_start(tab_buffer_t *tab, size_t line_no, size_t *pos) {
+  switch (tab->storage) {
+  case STORAGE_GapBuffer:
+    return gap_buffer_line_start(tab->txt_buffer, line_no, pos);
+  case STORAGE_PieceTable:
+    return piece_table_line_start(tab->piece_table, line_no, pos);
+  default:
+    return false;
+  }
+}
+
+void tab_buffer_activate(tab_buffer_t *tab) {
+  if (tab->arena == NULL)
+    tab->arena = arena_new();
+
+  if (tab->arena == NULL)
+    raise("Region allocation error");
+
+  current_arena = tab->arena;
+}
+
+void tab_buffer_close(tab_buffer_t *tab) {
+  // A pending save still reads a snapshot out of the tab's arena.
+  if (tab->save != NULL) {
+    save_t *save = tab->save;
+
+    tab->save = NULL;
+    save_finish(save);
+  }
+
+  if (tab->storage == STORAGE_PieceTable && tab->piece_table != NULL &&
+      tab->piece_table->mapped != NULL)
+    map_file_close(tab->piece_table->mapped);
+
+  // Text, indexes and history of the tab all came out of its arena, so a
+  // closed tab hands every byte back at once.
+  arena_destroy(tab->arena);
+  tab->arena = NULL;
+  tab->txt_buffer = NULL;
+}
+
+// At most one save runs per tab; starting another waits for the last.
+int tab_buffer_save(tab_buffer_t *tab, const char *path, journal_t *journal) {
+  if (tab->storage != STORAGE_GapBuffer)
+    return 0;
+
+  if (tab->save != NULL) {
+    save_t *save = tab->save;
+
+    tab->save = NULL;
+    save_finish(save);
+  }
+
+  tab->save = save_gap_buffer(tab->txt_buffer, path, tab->encoding, journal);
+  return 1;
+}
+
+// Reaps a finished save, raising its error if it failed.
+bool tab_buffer_poll_save(tab_buffer_t *tab, size_t *done, size_t *total) {
+  if (tab->save == NULL || !save_poll(tab->save, done, total))
+    return tab->save == NULL;
+
+  save_t *save = tab->save;
+
+  tab->save = NULL;
+  save_finish(save);
+  return true;
+}
+
+void tab_buffer_begin_group(tab_buffer_t *tab) {
+  if (tab->storage == STORAGE_GapBuffer)
+    gap_buffer_defer_index(tab->txt_buffer);
+}
+
+void tab_buffer_end_group(tab_buffer_t *tab) {
+  if (tab->storage == STORAGE_GapBuffer)
+    gap_buffer_commit_index(tab->txt_buffer);
+}
+
+int tab_buffer_open_file(tab_buffer_t *tab, const char *path) {
+  tab_buffer_activate(tab);
+  tab->storage = STORAGE_PieceTable;
+  tab->piece_table = piece_table_open_mapped(path);
+  tab->encoding = tab->piece_table->mapped->swapped ? ENCODING_Utf32Swapped
+                                                    : ENCODING_Utf32;
+  return 1;
+}
+
+bool gap_buffer_search(gap_buffer_t *buffer, regex_compiled_t *re, size_t from,
+                       regex_match_t *match) {
+  regex_text_t text = regex_text_compact(
+      buffer->contents, buffer->gap_start, buffer->width,
+      gap_buffer_at(buffer, buffer->gap_end),
+      buffer->contents_size - buffer->gap_end, buffer->width);
+
+  return regex_search_text(re, &text, from, match);
+}
+
+bool gap_buffer_search_captures(gap_buffer_t *buffer, regex_compiled_t *re,
+                                size_t from, size_t *caps) {
+  regex_text_t text = regex_text_compact(
+      buffer->contents, buffer->gap_start, buffer->width,
+      gap_buffer_at(buffer, buffer->gap_end),
+      buffer->contents_size - buffer->gap_end, buffer->width);
+
+  return regex_search_captures_text(re, &text, from, caps);
 }
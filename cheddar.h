@@ -6,16 +6,41 @@
 #include <stdio.h>
 #include <stdlib.h>
 
+#define TXT_NODE_MAX_ENTRIES 64
+
+typedef struct Arena Arena;
 typedef struct GAPBuffer gap_buffer_t;
+typedef struct PIECENode piece_node_t;
+typedef struct PIECETable piece_table_t;
+typedef struct MAPFile map_file_t;
+typedef struct TXTNode txt_node_t;
+typedef struct TXTBuffer txt_buffer_t;
+typedef struct TXTIter txt_iter_t;
 typedef struct ADDRBuffer addr_buffer_t;
 typedef struct REGEXPBuffer regexp_buffer_t;
 typedef struct WINBuffer win_buffer_t;
 typedef struct TABBuffer tab_buffer_t;
+typedef struct Save save_t;
+typedef struct Journal journal_t;
 
 struct TABBuffer {
   int tab_num;
+  Arena *arena;
   win_buffer_t *in_window;
-  gap_buffer_t *txt_buffer;
+  enum TABStorage {
+    STORAGE_GapBuffer,
+    STORAGE_PieceTable,
+  } storage;
+  enum TABEncoding {
+    ENCODING_Utf32,
+    ENCODING_Utf32Swapped,
+    ENCODING_Utf8,
+  } encoding;
+  union {
+    gap_buffer_t *txt_buffer;
+    piece_table_t *piece_table;
+  };
+  save_t *save;
   input_buffer_t *inp_buffer;
   output_buffer_t *outp_buffer const char32_t *title;
   bool vertical;
@@ -32,10 +57,76 @@ struct WINBuffer {
 };
 
 struct GAPBuffer {
-  char32_t *contents;
+  Arena *arena;
+  uint8_t *contents;
+  size_t *contents_refs;
   size_t contents_size;
+  unsigned width;
   size_t gap_start;
   size_t gap_end;
+  size_t *line_index;
+  size_t index_blocks;
+  bool index_deferred;
+  bool index_stale;
+};
+
+struct PIECENode {
+  bool in_added;
+  size_t offset;
+  size_t length;
+  size_t subtree_length;
+  uint32_t priority;
+  struct PIECENode *left;
+  struct PIECENode *right;
+};
+
+struct MAPFile {
+  Arena *arena;
+  void *mapping;
+  size_t mapping_size;
+  const char32_t *text;
+  size_t length;
+  bool swapped;
+  const char32_t **chunks;
+  size_t num_chunks;
+  size_t *line_counts;
+};
+
+struct PIECETable {
+  Arena *arena;
+  const char32_t *original;
+  size_t original_length;
+  map_file_t *mapped;
+  char32_t *added;
+  size_t added_length;
+  size_t added_size;
+  piece_node_t *root;
+  uint32_t seed;
+};
+
+struct TXTNode {
+  bool is_leaf;
+  size_t refs;
+  size_t num_entries;
+  size_t num_lines;
+  size_t mark;
+  union {
+    str_buffer_t *lines[TXT_NODE_MAX_ENTRIES];
+    struct TXTNode *children[TXT_NODE_MAX_ENTRIES];
+  };
+};
+
+struct TXTBuffer {
+  Arena *arena;
+  txt_node_t *root;
+  size_t num_lines;
+};
+
+struct TXTIter {
+  txt_buffer_t *buffer;
+  txt_node_t *leaf;
+  size_t slot;
+  size_t line_no;
 };
 
 struct ADDRBuffer {
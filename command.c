@@ -2,14 +2,25 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+
+#define CMD_CHECKPOINT_INTERVAL 256
+#define CMD_CHECKPOINT_BUDGET (16 * 1024 * 1024)
+#define CMD_VARINT_MAX 10
+#define CMD_RECORD_STACK_SIZE 256
+#define CMD_RECORD_TEXT 0xFF
 
 extern Arena *current_arena;
 
 typedef struct Command command_t;
+typedef struct CMDHistory cmd_history_t;
+typedef struct CMDCheckpoint cmd_checkpoint_t;
 typedef struct CMDLineInsert cmd_line_insert_t;
 typedef struct CMDSpliceChar cmd_splice_char_t;
 typedef struct CMDSpliceString cmd_splice_string_t;
 typedef struct CMDDeleteChunk cmd_delete_chunk_t;
+typedef struct CMDSubstituteLines cmd_substitute_lines_t;
+typedef struct CMDGroup cmd_group_t;
 
 struct Command {
   enum CMDKind {
@@ -17,26 +28,31 @@ struct Command {
     CMD_SpliceChar,
     CMD_SpliceString,
     CMD_DeleteChunk,
+    CMD_SubstituteLines,
+    CMD_Group,
     CMD_Undo,
     CMD_Redo,
   } cmd_kind;
 
   union {
-    cmd_line_inert_t v_line_insert;
+    cmd_line_insert_t v_line_insert;
     cmd_splice_char_t v_splice_char;
     cmd_splice_strig_t v_splice_string;
     cmd_delete_chunk_t v_delete_chunk;
+    cmd_substitute_lines_t v_substitute_lines;
+    cmd_group_t v_group;
     struct Command *v_command_list;
     // TODO: Add more
   };
 
+  size_t journal_end;
   struct Command *next;
   struct Command *prev;
 };
 
 struct CMDLineInsert {
   txt_buffer_t *buffer;
-  line_buffer_t *line;
+  str_buffer_t *line;
 };
 
 struct CMDSpliceChar {
@@ -51,6 +67,7 @@ struct CMDSpliceString {
   str_buffer_t *string;
   size_t line_no;
   size_t index;
+  bool coalesced;
 };
 
 struct CMDDeleteChunk {
@@ -60,45 +77,796 @@ struct CMDDeleteChunk {
   size_t span;
 };
 
-command_t *push_command(command_t **list, command_t *cmd) {
-  if (list == NULL || *list == NULL) {
-    *list = cmd;
-    return *list;
+struct CMDSubstituteLines {
+  txt_buffer_t *buffer;
+  size_t *line_nos;
+  str_buffer_t **old_lines;
+  str_buffer_t **new_lines;
+  size_t num_lines;
+};
+
+struct CMDGroup {
+  txt_buffer_t *buffer;
+  struct Command *head;
+  struct Command *tail;
+  size_t num_commands;
+};
+
+struct CMDCheckpoint {
+  txt_buffer_t *buffer;
+  txt_buffer_t *snapshot;
+  size_t bytes;
+  size_t position;
+  command_t *command;
+  time_t taken_at;
+  struct CMDCheckpoint *newer;
+  struct CMDCheckpoint *older;
+};
+
+struct CMDHistory {
+  Arena *arena;
+  command_t *head;
+  command_t *tail;
+  size_t length;
+  cmd_checkpoint_t *newest;
+  cmd_checkpoint_t *oldest;
+  size_t since_checkpoint;
+  size_t checkpoint_bytes;
+  size_t checkpoint_budget;
+  journal_t *journal;
+  size_t journal_start;
+  bool journal_stale;
+  command_t *group;
+  size_t group_depth;
+  tab_buffer_t *group_tab;
+};
+
+static bool command_coalesce(command_t *tail, command_t *cmd) {
+  if (tail->cmd_kind == CMD_SpliceChar && cmd->cmd_kind == CMD_SpliceChar) {
+    cmd_splice_char_t *last = &tail->v_splice_char;
+    cmd_splice_char_t *next = &cmd->v_splice_char;
+
+    if (last->buffer != next->buffer || last->line_no != next->line_no ||
+        next->at_pos != last->at_pos + 1)
+      return false;
+
+    str_buffer_t *string = str_buffer_new_blank(2);
+    string = str_buffer_add_char(string, last->chr);
+    string = str_buffer_add_char(string, next->chr);
+
+    tail->cmd_kind = CMD_SpliceString;
+    tail->v_splice_string.buffer = next->buffer;
+    tail->v_splice_string.string = string;
+    tail->v_splice_string.line_no = next->line_no;
+    tail->v_splice_string.index = next->at_pos - 1;
+    tail->v_splice_string.coalesced = true;
+    return true;
+  }
+
+  // Only strings built by coalescing are grown in place; a string handed
+  // to command_new_splice_string may still be referenced by the caller.
+  if (tail->cmd_kind == CMD_SpliceString && cmd->cmd_kind == CMD_SpliceChar) {
+    cmd_splice_string_t *last = &tail->v_splice_string;
+    cmd_splice_char_t *next = &cmd->v_splice_char;
+
+    if (!last->coalesced || last->buffer != next->buffer ||
+        last->line_no != next->line_no ||
+        next->at_pos != last->index + last->string->length)
+      return false;
+
+    last->string = str_buffer_add_char(last->string, next->chr);
+    return true;
+  }
+
+  if (tail->cmd_kind == CMD_DeleteChunk && cmd->cmd_kind == CMD_DeleteChunk) {
+    cmd_delete_chunk_t *last = &tail->v_delete_chunk;
+    cmd_delete_chunk_t *next = &cmd->v_delete_chunk;
+
+    if (last->buffer != next->buffer || last->line_no != next->line_no)
+      return false;
+
+    if (next->start == last->start) {
+      last->span += next->span;
+      return true;
+    }
+
+    if (next->start + next->span == last->start) {
+      last->start = next->start;
+      last->span += next->span;
+      return true;
+    }
+  }
+
+  return false;
+}
+
+static txt_buffer_t *command_buffer(command_t *cmd) {
+  switch (cmd->cmd_kind) {
+  case CMD_LineInsert:
+    return cmd->v_line_insert.buffer;
+  case CMD_SpliceChar:
+    return cmd->v_splice_char.buffer;
+  case CMD_SpliceString:
+    return cmd->v_splice_string.buffer;
+  case CMD_DeleteChunk:
+    return cmd->v_delete_chunk.buffer;
+  case CMD_SubstituteLines:
+    return cmd->v_substitute_lines.buffer;
+  case CMD_Group:
+    return cmd->v_group.buffer;
+  default:
+    return NULL;
+  }
+}
+
+static void command_apply_to(command_t *cmd, txt_buffer_t *buffer) {
+  switch (cmd->cmd_kind) {
+  case CMD_LineInsert:
+    txt_buffer_insert_line(buffer, cmd->v_line_insert.line);
+    break;
+  case CMD_SpliceChar:
+    insert_char_at_nth_line(buffer, cmd->v_splice_char.chr,
+                            cmd->v_splice_char.line_no,
+                            cmd->v_splice_char.at_pos);
+    break;
+  case CMD_SpliceString:
+    insert_substring_at_nth_line(buffer, cmd->v_splice_string.string,
+                                 cmd->v_splice_string.line_no,
+                                 cmd->v_splice_string.index);
+    break;
+  case CMD_DeleteChunk:
+    delete_chunk_at_nth_line(buffer, cmd->v_delete_chunk.line_no,
+                             cmd->v_delete_chunk.start,
+                             cmd->v_delete_chunk.span);
+    break;
+  case CMD_SubstituteLines:
+    for (size_t i = 0; i < cmd->v_substitute_lines.num_lines; i++)
+      *txt_buffer_at(buffer, cmd->v_substitute_lines.line_nos[i]) =
+          cmd->v_substitute_lines.new_lines[i];
+    break;
+  case CMD_Group:
+    for (command_t *member = cmd->v_group.head; member != NULL;
+         member = member->next)
+      command_apply_to(member, buffer);
+    break;
+  default:
+    break;
+  }
+}
+
+void command_apply(command_t *cmd) {
+  command_apply_to(cmd, command_buffer(cmd));
+}
+
+static void checkpoint_free(cmd_history_t *history, cmd_checkpoint_t *cp) {
+  if (cp->newer != NULL)
+    cp->newer->older = cp->older;
+  else
+    history->newest = cp->older;
+
+  if (cp->older != NULL)
+    cp->older->newer = cp->newer;
+  else
+    history->oldest = cp->newer;
+
+  history->checkpoint_bytes -= cp->bytes;
+  txt_buffer_free(cp->snapshot);
+  free(cp);
+}
+
+// A checkpoint is a clone of the line tree and shares most nodes and lines
+// with the versions after it. Checkpoints go oldest first, so dropping one
+// frees what its newer neighbour, or the live text for the newest, no longer
+// holds, and that is what it is charged.
+static void checkpoint_measure(cmd_history_t *history, cmd_checkpoint_t *cp) {
+  txt_buffer_t *newer = cp->newer != NULL ? cp->newer->snapshot : cp->buffer;
+
+  history->checkpoint_bytes -= cp->bytes;
+  cp->bytes = sizeof(cmd_checkpoint_t) +
+              txt_buffer_held_bytes(cp->snapshot, newer);
+  history->checkpoint_bytes += cp->bytes;
+}
+
+// A charge only changes with the checkpoint's newer neighbour. The newest
+// is measured against text that has moved on, and the one before it may
+// have just gained a neighbour, so those two are measured again. Dropping
+// the oldest leaves every other charge as it was. The newest checkpoint is
+// kept whatever it costs.
+static void checkpoint_trim(cmd_history_t *history) {
+  cmd_checkpoint_t *cp = history->newest;
+
+  for (int i = 0; i < 2 && cp != NULL; i++, cp = cp->older)
+    checkpoint_measure(history, cp);
+
+  while (history->oldest != history->newest &&
+         history->checkpoint_bytes > history->checkpoint_budget)
+    checkpoint_free(history, history->oldest);
+}
+
+cmd_checkpoint_t *command_history_checkpoint(cmd_history_t *history,
+                                             txt_buffer_t *buffer) {
+  cmd_checkpoint_t *cp = malloc(sizeof(cmd_checkpoint_t));
+
+  if (cp == NULL)
+    raise("Memory allocation error");
+
+  cp->buffer = buffer;
+  cp->snapshot = txt_buffer_clone(buffer);
+  cp->bytes = 0;
+  cp->position = history->length;
+  cp->command = history->tail;
+  cp->taken_at = time(NULL);
+  cp->newer = NULL;
+  cp->older = history->newest;
+
+  if (history->newest != NULL)
+    history->newest->newer = cp;
+  else
+    history->oldest = cp;
+
+  history->newest = cp;
+  history->since_checkpoint = 0;
+  checkpoint_trim(history);
+  return cp;
+}
+
+void command_history_set_checkpoint_budget(cmd_history_t *history,
+                                           size_t budget) {
+  history->checkpoint_budget = budget;
+  checkpoint_trim(history);
+}
+
+cmd_history_t *command_history_new(txt_buffer_t *buffer) {
+  cmd_history_t *history = request_memory(current_arena, sizeof(cmd_history_t));
+  history->arena = current_arena;
+  history->head = NULL;
+  history->tail = NULL;
+  history->length = 0;
+  history->newest = NULL;
+  history->oldest = NULL;
+  history->since_checkpoint = 0;
+  history->checkpoint_bytes = 0;
+  history->checkpoint_budget = CMD_CHECKPOINT_BUDGET;
+  history->journal = NULL;
+  history->journal_start = 0;
+  history->journal_stale = false;
+  history->group = NULL;
+  history->group_depth = 0;
+  history->group_tab = NULL;
+  command_history_checkpoint(history, buffer);
+  return history;
+}
+
+static size_t command_put_string(uint8_t *out, const str_buffer_t *string) {
+  size_t length = journal_put_varint(out, string->length);
+
+  for (size_t i = 0; i < string->length; i++)
+    length += journal_put_varint(&out[length], string->contents[i]);
+
+  return length;
+}
+
+static size_t command_record_bound(command_t *cmd) {
+  size_t chars = 0, fields = 4;
+
+  switch (cmd->cmd_kind) {
+  case CMD_LineInsert:
+    chars = cmd->v_line_insert.line->length;
+    break;
+  case CMD_SpliceString:
+    chars = cmd->v_splice_string.string->length;
+    break;
+  case CMD_SubstituteLines:
+    for (size_t i = 0; i < cmd->v_substitute_lines.num_lines; i++)
+      chars += cmd->v_substitute_lines.new_lines[i]->length;
+    fields += 2 * cmd->v_substitute_lines.num_lines;
+    break;
+  case CMD_Group: {
+    size_t bound = 1 + CMD_VARINT_MAX;
+
+    for (command_t *member = cmd->v_group.head; member != NULL;
+         member = member->next)
+      bound += CMD_VARINT_MAX + command_record_bound(member);
+
+    return bound;
   }
+  default:
+    break;
+  }
+
+  return 1 + (fields + chars) * CMD_VARINT_MAX;
+}
 
-  command_t *head = *list;
+static size_t command_encode(uint8_t *record, command_t *cmd) {
+  size_t length = 1;
 
-  while (head->next != NULL)
-    head = head->next;
+  record[0] = cmd->cmd_kind;
 
-  cmd->prev = head;
-  head->next = cmd;
+  switch (cmd->cmd_kind) {
+  case CMD_LineInsert:
+    length += command_put_string(&record[length], cmd->v_line_insert.line);
+    break;
+  case CMD_SpliceChar:
+    length += journal_put_varint(&record[length], cmd->v_splice_char.line_no);
+    length += journal_put_varint(&record[length], cmd->v_splice_char.at_pos);
+    length += journal_put_varint(&record[length], cmd->v_splice_char.chr);
+    break;
+  case CMD_SpliceString:
+    length +=
+        journal_put_varint(&record[length], cmd->v_splice_string.line_no);
+    length += journal_put_varint(&record[length], cmd->v_splice_string.index);
+    length +=
+        command_put_string(&record[length], cmd->v_splice_string.string);
+    break;
+  case CMD_DeleteChunk:
+    length += journal_put_varint(&record[length], cmd->v_delete_chunk.line_no);
+    length += journal_put_varint(&record[length], cmd->v_delete_chunk.start);
+    length += journal_put_varint(&record[length], cmd->v_delete_chunk.span);
+    break;
+  case CMD_SubstituteLines:
+    length += journal_put_varint(&record[length],
+                                 cmd->v_substitute_lines.num_lines);
+    for (size_t i = 0; i < cmd->v_substitute_lines.num_lines; i++) {
+      length += journal_put_varint(&record[length],
+                                   cmd->v_substitute_lines.line_nos[i]);
+      length += command_put_string(&record[length],
+                                   cmd->v_substitute_lines.new_lines[i]);
+    }
+    break;
+  case CMD_Group:
+    // Members are framed one after another inside a single record, so a
+    // group is either replayed whole or not at all.
+    length += journal_put_varint(&record[length], cmd->v_group.num_commands);
+    for (command_t *member = cmd->v_group.head; member != NULL;
+         member = member->next) {
+      uint8_t *frame = &record[length];
+      size_t inner = command_encode(&frame[CMD_VARINT_MAX], member);
 
-  return head;
+      length += journal_put_varint(frame, inner);
+      memmove(&record[length], &frame[CMD_VARINT_MAX], inner);
+      length += inner;
+    }
+    break;
+  default:
+    length = 0;
+    break;
+  }
+
+  return length;
 }
 
-command_t *pop_command(command_t **list) {
-  if (list == NULL || *list == NULL)
+static void command_journal(journal_t *journal, command_t *cmd) {
+  uint8_t stack[CMD_RECORD_STACK_SIZE];
+  size_t bound = command_record_bound(cmd);
+  uint8_t *record = bound <= sizeof(stack) ? stack : malloc(bound);
+
+  if (record == NULL)
+    raise("Memory allocation error");
+
+  size_t length = command_encode(record, cmd);
+
+  if (length > 0)
+    journal_append(journal, record, length);
+
+  if (record != stack)
+    free(record);
+}
+
+// The whole text as one record, for when the journal cannot be cut back to
+// the surviving history.
+static void command_journal_text(journal_t *journal, txt_buffer_t *buffer) {
+  size_t bound = 1 + CMD_VARINT_MAX;
+  txt_iter_t iter;
+  str_buffer_t *line;
+
+  txt_buffer_iter_init(&iter, buffer, 0);
+
+  while ((line = txt_buffer_iter_next(&iter)) != NULL)
+    bound += (1 + line->length) * CMD_VARINT_MAX;
+
+  uint8_t *record = malloc(bound);
+
+  if (record == NULL)
+    raise("Memory allocation error");
+
+  size_t length = 1;
+
+  record[0] = CMD_RECORD_TEXT;
+  length += journal_put_varint(&record[length], buffer->num_lines);
+  txt_buffer_iter_init(&iter, buffer, 0);
+
+  while ((line = txt_buffer_iter_next(&iter)) != NULL)
+    length += command_put_string(&record[length], line);
+
+  journal_append(journal, record, length);
+  free(record);
+}
+
+// The text the history leaves at its current length, rebuilt from the
+// nearest checkpoint into a clone so the live buffer is not touched.
+static txt_buffer_t *command_history_text(cmd_history_t *history) {
+  cmd_checkpoint_t *cp = history->newest;
+
+  while (cp != NULL && cp->position > history->length)
+    cp = cp->older;
+
+  if (cp == NULL)
     return NULL;
 
-  command_t *head = *list;
+  txt_buffer_t *text = txt_buffer_clone(cp->snapshot);
+  command_t *cmd = cp->command != NULL ? cp->command->next : history->head;
+
+  for (size_t i = cp->position; i < history->length; i++, cmd = cmd->next)
+    command_apply_to(cmd, text);
+
+  return text;
+}
+
+// After an undo or a revert the journal must describe only the surviving
+// history, or replay would bring the dropped edits back. It is cut after the
+// record of the new tail; when that record predates the journal, the whole
+// text is written instead, and failing that on the next push.
+static void command_journal_rewind(cmd_history_t *history) {
+  journal_t *journal = history->journal;
 
-  while (head->next != NULL)
-    head = head->next;
+  if (journal == NULL)
+    return;
 
-  if (head->prev != NULL) {
-    head->prev->next = NULL;
-    head->prev = NULL;
+  size_t mark = history->tail != NULL ? history->tail->journal_end
+                                      : history->journal_start;
+
+  if (journal_rewind(journal, mark)) {
+    history->journal_stale = false;
+    return;
+  }
+
+  txt_buffer_t *text = command_history_text(history);
+
+  if (text == NULL) {
+    history->journal_stale = true;
+    return;
   }
 
-  return head;
+  journal_reset(journal);
+  command_journal_text(journal, text);
+  txt_buffer_free(text);
+
+  if (history->tail != NULL)
+    history->tail->journal_end = journal_mark(journal);
+  else
+    history->journal_start = journal_mark(journal);
+
+  history->journal_stale = false;
 }
 
-command_t *command_new_insert_line(txt_buffer_t *buffer, line_buffer_t *line) {
+static bool command_get_string(const uint8_t **cursor, const uint8_t *end,
+                               str_buffer_t **string) {
+  uint64_t length, chr;
+
+  if (!journal_get_varint(cursor, end, &length) ||
+      length > (uint64_t)(end - *cursor))
+    return false;
+
+  *string = str_buffer_new_blank(length);
+
+  for (uint64_t i = 0; i < length; i++) {
+    if (!journal_get_varint(cursor, end, &chr))
+      return false;
+    *string = str_buffer_add_char(*string, chr);
+  }
+
+  return true;
+}
+
+static bool command_replay_record(const uint8_t *payload, size_t length,
+                                  void *ctx) {
+  txt_buffer_t *buffer = ctx;
+  const uint8_t *cursor = &payload[1];
+  const uint8_t *end = &payload[length];
+  uint64_t a, b, c;
+  str_buffer_t *string;
+
+  if (length == 0)
+    return false;
+
+  switch (payload[0]) {
+  case CMD_LineInsert:
+    if (!command_get_string(&cursor, end, &string))
+      return false;
+    txt_buffer_insert_line(buffer, string);
+    return true;
+  case CMD_SpliceChar:
+    if (!journal_get_varint(&cursor, end, &a) ||
+        !journal_get_varint(&cursor, end, &b) ||
+        !journal_get_varint(&cursor, end, &c) || a >= buffer->num_lines)
+      return false;
+    insert_char_at_nth_line(buffer, c, a, b);
+    return true;
+  case CMD_SpliceString:
+    if (!journal_get_varint(&cursor, end, &a) ||
+        !journal_get_varint(&cursor, end, &b) ||
+        !command_get_string(&cursor, end, &string) || a >= buffer->num_lines)
+      return false;
+    insert_substring_at_nth_line(buffer, string, a, b);
+    return true;
+  case CMD_DeleteChunk:
+    if (!journal_get_varint(&cursor, end, &a) ||
+        !journal_get_varint(&cursor, end, &b) ||
+        !journal_get_varint(&cursor, end, &c) || a >= buffer->num_lines)
+      return false;
+    delete_chunk_at_nth_line(buffer, a, b, c);
+    return true;
+  case CMD_SubstituteLines:
+    if (!journal_get_varint(&cursor, end, &c))
+      return false;
+    for (uint64_t i = 0; i < c; i++) {
+      if (!journal_get_varint(&cursor, end, &a) ||
+          !command_get_string(&cursor, end, &string) || a >= buffer->num_lines)
+        return false;
+      *txt_buffer_at(buffer, a) = string;
+    }
+    return true;
+  case CMD_Group:
+    if (!journal_get_varint(&cursor, end, &c))
+      return false;
+    for (uint64_t i = 0; i < c; i++) {
+      if (!journal_get_varint(&cursor, end, &a) ||
+          a > (uint64_t)(end - cursor) ||
+          !command_replay_record(cursor, a, buffer))
+        return false;
+      cursor += a;
+    }
+    return true;
+  case CMD_RECORD_TEXT: {
+    if (!journal_get_varint(&cursor, end, &c) ||
+        c > (uint64_t)(end - cursor))
+      return false;
+
+    str_buffer_t **lines = malloc((c > 0 ? c : 1) * sizeof(str_buffer_t *));
+
+    if (lines == NULL)
+      raise("Memory allocation error");
+
+    for (uint64_t i = 0; i < c; i++) {
+      if (!command_get_string(&cursor, end, &lines[i])) {
+        free(lines);
+        return false;
+      }
+    }
+
+    txt_buffer_assign(buffer, lines, c);
+    free(lines);
+    return true;
+  }
+  default:
+    return false;
+  }
+}
+
+size_t command_replay_journal(const char *document_path,
+                              txt_buffer_t *buffer) {
+  return journal_replay(document_path, command_replay_record, buffer);
+}
+
+void command_history_set_journal(cmd_history_t *history, journal_t *journal) {
+  history->journal = journal;
+  history->journal_start = journal != NULL ? journal_mark(journal) : 0;
+  history->journal_stale = false;
+}
+
+command_t *command_new_group(txt_buffer_t *buffer) {
   command_t *cmd = request_memory(current_arena, sizeof(command_t));
-  cmd->cmd_kind = CMD_InsertLine;
-  cmd->v_insert_line.buffer = buffer;
-  cmd->v_insert_line.line = line;
+  cmd->cmd_kind = CMD_Group;
+  cmd->v_group.buffer = buffer;
+  cmd->v_group.head = NULL;
+  cmd->v_group.tail = NULL;
+  cmd->v_group.num_commands = 0;
+  return cmd;
+}
+
+static command_t *command_group_add(cmd_history_t *history, command_t *cmd) {
+  cmd_group_t *members = &history->group->v_group;
+
+  if (members->tail != NULL && command_coalesce(members->tail, cmd)) {
+    arena_recycle(history->arena, cmd, sizeof(command_t));
+    return members->tail;
+  }
+
+  cmd->next = NULL;
+  cmd->prev = members->tail;
+
+  if (members->tail != NULL)
+    members->tail->next = cmd;
+  else
+    members->head = cmd;
+
+  members->tail = cmd;
+  members->num_commands++;
+  return cmd;
+}
+
+command_t *push_command(cmd_history_t *history, command_t *cmd) {
+  // Inside a group nothing reaches the journal or the checkpoint counter
+  // until the group is committed as one entry.
+  if (history->group != NULL)
+    return command_group_add(history, cmd);
+
+  // Every command is journaled as issued, before it is coalesced. A journal
+  // left behind by an undo gets the whole text, which already holds cmd.
+  size_t journal_end = SIZE_MAX;
+
+  if (history->journal != NULL) {
+    txt_buffer_t *buffer = command_buffer(cmd);
+
+    if (history->journal_stale && buffer != NULL) {
+      journal_reset(history->journal);
+      command_journal_text(history->journal, buffer);
+      history->journal_stale = false;
+    } else {
+      command_journal(history->journal, cmd);
+    }
+
+    journal_end = journal_mark(history->journal);
+  }
+
+  // A command already captured by a checkpoint must not change afterwards.
+  bool sealed = history->newest != NULL &&
+                history->newest->position == history->length;
+
+  // The absorbed command goes back to its size class, so a long typing run
+  // reuses one node instead of leaking one per keystroke. Nodes always go
+  // back to the history's own arena, whichever tab is active.
+  if (history->tail != NULL && !sealed &&
+      command_coalesce(history->tail, cmd)) {
+    arena_recycle(history->arena, cmd, sizeof(command_t));
+    history->tail->journal_end = journal_end;
+    return history->tail;
+  }
+
+  cmd->journal_end = journal_end;
+  cmd->next = NULL;
+  cmd->prev = history->tail;
+
+  if (history->tail != NULL)
+    history->tail->next = cmd;
+  else
+    history->head = cmd;
+
+  history->tail = cmd;
+  history->length++;
+
+  txt_buffer_t *buffer = command_buffer(cmd);
+
+  if (++history->since_checkpoint >= CMD_CHECKPOINT_INTERVAL && buffer != NULL)
+    command_history_checkpoint(history, buffer);
+
+  return cmd;
+}
+
+// The tab, if given, keeps its storage index deferred until the outermost
+// group ends, so a batch of edits rebuilds it once.
+void command_history_begin_group(cmd_history_t *history, txt_buffer_t *buffer,
+                                 tab_buffer_t *tab) {
+  if (history->group_depth++ > 0)
+    return;
+
+  history->group = command_new_group(buffer);
+  history->group_tab = tab;
+
+  if (tab != NULL)
+    tab_buffer_begin_group(tab);
+}
+
+command_t *command_history_end_group(cmd_history_t *history) {
+  if (history->group_depth == 0 || --history->group_depth > 0)
+    return NULL;
+
+  command_t *group = history->group;
+  tab_buffer_t *tab = history->group_tab;
+
+  history->group = NULL;
+  history->group_tab = NULL;
+
+  if (tab != NULL)
+    tab_buffer_end_group(tab);
+
+  // Even a lone member stays wrapped, so it is never coalesced into the
+  // entry before it and undoes as a step of its own.
+  if (group->v_group.num_commands > 0)
+    return push_command(history, group);
+
+  arena_recycle(history->arena, group, sizeof(command_t));
+  return NULL;
+}
+
+void command_discard(cmd_history_t *history, command_t *cmd) {
+  while (cmd != NULL) {
+    command_t *next = cmd->next;
+
+    if (cmd->cmd_kind == CMD_Group)
+      command_discard(history, cmd->v_group.head);
+
+    arena_recycle(history->arena, cmd, sizeof(command_t));
+    cmd = next;
+  }
+}
+
+bool command_history_revert(cmd_history_t *history, size_t position,
+                            command_t **undone) {
+  cmd_checkpoint_t *cp = history->newest;
+
+  while (cp != NULL && cp->position > position)
+    cp = cp->older;
+
+  if (cp == NULL || position > history->length)
+    return false;
+
+  txt_buffer_t *buffer = cp->buffer;
+
+  txt_buffer_restore(buffer, cp->snapshot);
+
+  // Replay only the commands between the checkpoint and the target.
+  command_t *cmd = cp->command != NULL ? cp->command->next : history->head;
+
+  for (size_t i = cp->position; i < position; i++, cmd = cmd->next)
+    command_apply(cmd);
+
+  // Whatever follows the target is detached and handed back for redo.
+  *undone = cmd;
+
+  if (cmd != NULL) {
+    history->tail = cmd->prev;
+    cmd->prev = NULL;
+
+    if (history->tail != NULL)
+      history->tail->next = NULL;
+    else
+      history->head = NULL;
+  }
+
+  history->length = position;
+
+  while (history->newest != NULL && history->newest->position > position)
+    checkpoint_free(history, history->newest);
+
+  history->since_checkpoint = position - history->newest->position;
+  command_journal_rewind(history);
+  return true;
+}
+
+// Undoes the newest command. The text is put back as it was before it, in
+// the same step that cuts the journal, so the two never disagree; the
+// command is handed back detached for redo. Nothing is popped once the
+// command predates the oldest checkpoint.
+command_t *pop_command(cmd_history_t *history) {
+  command_t *tail;
+
+  if (history->tail == NULL ||
+      !command_history_revert(history, history->length - 1, &tail))
+    return NULL;
+
+  return tail;
+}
+
+bool command_history_revert_to_time(cmd_history_t *history, time_t when,
+                                    command_t **undone) {
+  cmd_checkpoint_t *cp = history->newest;
+
+  while (cp != NULL && cp->taken_at > when)
+    cp = cp->older;
+
+  if (cp == NULL)
+    return false;
+
+  return command_history_revert(history, cp->position, undone);
+}
+
+command_t *command_new_insert_line(txt_buffer_t *buffer,
+                                   str_buffer_t *line) {
+  command_t *cmd = request_memory(current_arena, sizeof(command_t));
+  cmd->cmd_kind = CMD_LineInsert;
+  cmd->v_line_insert.buffer = buffer;
+  cmd->v_line_insert.line = line;
   return cmd;
 }
 
@@ -121,6 +889,7 @@ command_t *command_new_splice_string(txt_buffer_t *buffer, str_buffer_t *string,
   cmd->v_splice_string.string = string;
   cmd->v_splice_string.line_no = line_no;
   cmd->v_splice_string.index = index;
+  cmd->v_splice_string.coalesced = false;
   return cmd;
 }
 
@@ -135,6 +904,20 @@ command_t *command_new_delete_chunk(txt_buffer_t *buffer, size_t line_no,
   return cmd;
 }
 
+command_t *command_new_substitute_lines(txt_buffer_t *buffer, size_t *line_nos,
+                                        str_buffer_t **old_lines,
+                                        str_buffer_t **new_lines,
+                                        size_t num_lines) {
+  command_t *cmd = request_memory(current_arena, sizeof(command_t));
+  cmd->cmd_kind = CMD_SubstituteLines;
+  cmd->v_substitute_lines.buffer = buffer;
+  cmd->v_substitute_lines.line_nos = line_nos;
+  cmd->v_substitute_lines.old_lines = old_lines;
+  cmd->v_substitute_lines.new_lines = new_lines;
+  cmd->v_substitute_lines.num_lines = num_lines;
+  return cmd;
+}
+
 command_t *command_new_undo(void) {
   command_t *cmd = request_memory(current_arena, sizeof(command_t));
   cmd->cmd_kind = CMD_Undo;
@@ -1,39 +1,96 @@
+#include <pthread.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 #define LINE_BUFFER_INIT_CAP 1024
-#define TXT_BUFFER_INIT_CAP 512
+#define PARALLEL_MAX_WORKERS 64
+#define PARALLEL_MIN_SHARD_LINES 4096
 
 extern Arena *current_arena;
 
+typedef struct EDITShard edit_shard_t;
+
+struct EDITShard {
+  regex_compiled_t *re;
+  txt_buffer_t *buffer;
+  size_t start_line;
+  size_t end_line;
+  bool global;
+  size_t stride;
+  size_t *hits;
+  size_t num_hits;
+  size_t capacity;
+  Arena *arena;
+  regex_scratch_t *scratch;
+  bool failed;
+};
+
 static size_t line_number = 0;
 static bool is_big_endian = false;
 
-line_buffer_t *read_line(void) {
+static str_buffer_t *read_line_append(str_buffer_t *line_buffer,
+                                      const char32_t *span, size_t length) {
+  if (line_buffer->length + length > line_buffer->size) {
+    size_t size = line_buffer->size * 2;
+
+    if (size < line_buffer->length + length)
+      size = line_buffer->length + length;
+
+    str_buffer_t *grown = str_buffer_new_blank(size);
+
+    memcpy(grown->contents, line_buffer->contents,
+           line_buffer->length * sizeof(char32_t));
+    grown->length = line_buffer->length;
+    line_buffer = grown;
+  }
+
+  memcpy(&line_buffer->contents[line_buffer->length], span,
+         length * sizeof(char32_t));
+  line_buffer->length += length;
+  return line_buffer;
+}
+
+static str_buffer_t *read_line_string(void) {
   str_buffer_t *line_buffer = str_buffer_new_blank(LINE_BUFFER_INIT_CAP);
-  char32_t read_char = 0;
+  size_t length = 0;
 
-  while (read_char != '\n') {
-    read_char = read_u32_character(&is_big_endian);
-    if (read_char == -1)
+  do {
+    const char32_t *span = read_u32_span(&is_big_endian, &length);
+    if (span == NULL)
       return NULL;
 
-    line_buffer = str_buffer_add_char(line_buffer, read_char);
-  }
+    line_buffer = read_line_append(line_buffer, span, length);
+  } while (line_buffer->contents[line_buffer->length - 1] != '\n');
+
+  return line_buffer;
+}
+
+line_buffer_t *read_line(void) {
+  str_buffer_t *line_buffer = read_line_string();
+
+  if (line_buffer == NULL)
+    return NULL;
 
   return line_buffer_new(line_buffer, ++line_number);
 }
 
+// Lines go into the text buffer as plain strings, so they are read without
+// the line_buffer_t wrapper; the line count still advances for each one.
 txt_buffer_t *read_lines_to_text_buffer(void) {
-  line_buffer_t *curr_line = NULL;
-  txt_buffer_t *text_buffer = txt_buffer_new_blank(TXT_BUFFER_INIT_CAP);
+  str_buffer_t *curr_line = NULL;
+  txt_buffer_t *text_buffer = txt_buffer_new_blank();
 
   while (true) {
-    curr_line = read_line();
-    if (curr_line == NULL || str_buffer_equals(curr_line, MARK_END_EDIT))
+    curr_line = read_line_string();
+    if (curr_line == NULL)
+      break;
+
+    line_number++;
+    if (str_buffer_equals(curr_line, MARK_END_EDIT))
       break;
 
     text_buffer = txt_buffer_insert_line(text_buffer, curr_line);
@@ -44,18 +101,265 @@ txt_buffer_t *read_lines_to_text_buffer(void) {
 
 void insert_char_at_nth_line(txt_buffer_t *buffer, char32_t chr, size_t line_no,
                              size_t at_pos) {
-  buffer->lines[line_no] =
-      str_buffer_splice_char(buffer->lines[line_no], at_pos, at_pos + 1, chr);
+  str_buffer_t **line = txt_buffer_at(buffer, line_no);
+
+  *line = str_buffer_splice_char(*line, at_pos, at_pos + 1, chr);
 }
 
 void insert_substring_at_nth_line(txt_buffer_t *buffer, str_buffer_t *substring,
                                   size_t line_no, size_t index) {
-  buffer->lines[line_no] =
-      str_buffer_splice_substring(buffer->lines[line_no], substring, index);
+  str_buffer_t **line = txt_buffer_at(buffer, line_no);
+
+  *line = str_buffer_splice_substring(*line, substring, index);
 }
 
 void delete_chunk_at_nth_line(txt_buffer_t *buffer, size_t line_no,
                               size_t start, size_t span) {
-  buffer->lines[line_no] =
-      str_buffer_remove_chunk(buffer->lines[line_no], start, span);
+  str_buffer_t **line = txt_buffer_at(buffer, line_no);
+
+  *line = str_buffer_remove_chunk(*line, start, span);
+}
+
+static size_t *edit_shard_next_hit(edit_shard_t *shard) {
+  if (shard->num_hits == shard->capacity) {
+    size_t capacity = shard->capacity == 0 ? 256 : shard->capacity * 2;
+    size_t *hits =
+        realloc(shard->hits, capacity * shard->stride * sizeof(size_t));
+
+    if (hits == NULL)
+      return NULL;
+
+    shard->hits = hits;
+    shard->capacity = capacity;
+  }
+
+  return &shard->hits[shard->num_hits++ * shard->stride];
+}
+
+// Runs on a worker thread, so nothing in here may raise: the scratch is
+// built beforehand and a failed allocation is left in shard->failed.
+static void *edit_shard_run(void *arg) {
+  edit_shard_t *shard = arg;
+  regex_scratch_t *scratch = shard->scratch;
+  size_t *caps = scratch->match_caps;
+  regex_match_t match;
+  txt_iter_t lines;
+
+  txt_buffer_iter_init(&lines, shard->buffer, shard->start_line);
+
+  // A stride of one records matching line numbers only; wider strides also
+  // keep the capture slots of every match for substitution.
+  for (size_t line_no = shard->start_line;
+       line_no < shard->end_line && !shard->failed; line_no++) {
+    str_buffer_t *line = txt_buffer_iter_next(&lines);
+    regex_text_t text =
+        regex_text_segments(line->contents, line->length, NULL, 0);
+    size_t pos = 0, last_end = SIZE_MAX;
+
+    while (pos <= line->length) {
+      if (shard->stride == 1) {
+        if (!regex_search_scratch(shard->re, scratch, &text, pos, &match))
+          break;
+
+        // Whole-match slots are all that the offset and adjacency checks
+        // read, so a plain search fills just those.
+        caps[0] = match.start;
+        caps[1] = match.end;
+      } else if (!regex_search_captures_scratch(shard->re, scratch, &text, pos,
+                                                caps)) {
+        break;
+      }
+
+      if (shard->global && regex_match_adjacent(caps, last_end)) {
+        pos = caps[0] + 1;
+        continue;
+      }
+
+      size_t *hit = edit_shard_next_hit(shard);
+
+      if (hit == NULL) {
+        shard->failed = true;
+        break;
+      }
+
+      hit[0] = line_no;
+      memcpy(&hit[1], caps, (shard->stride - 1) * sizeof(size_t));
+
+      if (!shard->global)
+        break;
+      last_end = caps[1];
+      pos = regex_next_offset(caps);
+    }
+  }
+
+  return NULL;
+}
+
+static size_t edit_worker_count(size_t num_lines) {
+  long cores = sysconf(_SC_NPROCESSORS_ONLN);
+  size_t workers = cores > 0 ? (size_t)cores : 1;
+  size_t by_lines = num_lines / PARALLEL_MIN_SHARD_LINES + 1;
+
+  if (workers > by_lines)
+    workers = by_lines;
+  if (workers > PARALLEL_MAX_WORKERS)
+    workers = PARALLEL_MAX_WORKERS;
+
+  return workers;
+}
+
+static void edit_free_shards(edit_shard_t *shards, size_t num_shards) {
+  for (size_t i = 0; i < num_shards; i++) {
+    free(shards[i].hits);
+
+    if (shards[i].scratch != NULL)
+      regex_scratch_free(shards[i].scratch);
+    if (shards[i].arena != NULL)
+      arena_destroy(shards[i].arena);
+  }
+
+  free(shards);
+}
+
+static edit_shard_t *edit_run_shards(txt_buffer_t *buffer,
+                                     regex_compiled_t *re, size_t start_line,
+                                     size_t end_line, bool global,
+                                     size_t stride, size_t *num_shards) {
+  if (end_line > buffer->num_lines)
+    end_line = buffer->num_lines;
+  if (start_line > end_line)
+    start_line = end_line;
+
+  size_t num_lines = end_line - start_line;
+  size_t workers = edit_worker_count(num_lines);
+  size_t per_shard = (num_lines + workers - 1) / workers;
+  edit_shard_t *shards = calloc(workers, sizeof(edit_shard_t));
+  pthread_t threads[PARALLEL_MAX_WORKERS];
+  bool spawned[PARALLEL_MAX_WORKERS] = {false};
+
+  if (shards == NULL)
+    raise("Memory allocation error");
+
+  for (size_t i = 0; i < workers; i++) {
+    size_t first = start_line + i * per_shard;
+    size_t last = first + per_shard;
+
+    shards[i].re = re;
+    shards[i].buffer = buffer;
+    shards[i].start_line = first < end_line ? first : end_line;
+    shards[i].end_line = last < end_line ? last : end_line;
+    shards[i].global = global;
+    shards[i].stride = stride;
+    shards[i].arena = arena_new();
+
+    if (shards[i].arena == NULL) {
+      edit_free_shards(shards, workers);
+      raise("Memory allocation error");
+    }
+
+    shards[i].scratch = regex_scratch_new(re, shards[i].arena);
+  }
+
+  // Shard 0 runs on the calling thread. A shard whose thread cannot be
+  // started is run inline instead of failing the whole command.
+  for (size_t i = 1; i < workers; i++)
+    spawned[i] =
+        pthread_create(&threads[i], NULL, edit_shard_run, &shards[i]) == 0;
+
+  edit_shard_run(&shards[0]);
+
+  for (size_t i = 1; i < workers; i++) {
+    if (spawned[i])
+      pthread_join(threads[i], NULL);
+    else
+      edit_shard_run(&shards[i]);
+  }
+
+  for (size_t i = 0; i < workers; i++) {
+    if (shards[i].failed) {
+      edit_free_shards(shards, workers);
+      raise("Memory allocation error");
+    }
+  }
+
+  *num_shards = workers;
+  return shards;
+}
+
+size_t *parallel_global_search(txt_buffer_t *buffer, regex_compiled_t *re,
+                               size_t start_line, size_t end_line,
+                               size_t *num_matches) {
+  size_t num_shards = 0;
+  edit_shard_t *shards = edit_run_shards(buffer, re, start_line, end_line,
+                                         false, 1, &num_shards);
+  size_t total = 0;
+
+  for (size_t i = 0; i < num_shards; i++)
+    total += shards[i].num_hits;
+
+  size_t *line_nos = request_memory(current_arena, total * sizeof(size_t));
+
+  // Shards cover consecutive line ranges, so concatenating them in shard
+  // order yields matches in line order.
+  total = 0;
+  for (size_t i = 0; i < num_shards; i++) {
+    memcpy(&line_nos[total], shards[i].hits,
+           shards[i].num_hits * sizeof(size_t));
+    total += shards[i].num_hits;
+  }
+
+  edit_free_shards(shards, num_shards);
+  *num_matches = total;
+  return line_nos;
+}
+
+command_t *parallel_global_substitute(txt_buffer_t *buffer,
+                                      regex_compiled_t *re,
+                                      const char32_t *replace,
+                                      size_t start_line, size_t end_line,
+                                      bool global) {
+  size_t stride = re->prog->num_slots + 1;
+  size_t num_shards = 0;
+  edit_shard_t *shards = edit_run_shards(buffer, re, start_line, end_line,
+                                         global, stride, &num_shards);
+  size_t total = 0;
+
+  for (size_t i = 0; i < num_shards; i++)
+    total += shards[i].num_hits;
+
+  size_t *line_nos = request_memory(current_arena, total * sizeof(size_t));
+  str_buffer_t **old_lines =
+      request_memory(current_arena, total * sizeof(str_buffer_t *));
+  str_buffer_t **new_lines =
+      request_memory(current_arena, total * sizeof(str_buffer_t *));
+  size_t num_lines = 0;
+
+  // Rebuilding lines allocates from the edit arena, so it happens here on
+  // the calling thread once every shard has finished matching.
+  for (size_t i = 0; i < num_shards; i++) {
+    edit_shard_t *shard = &shards[i];
+    size_t first = 0;
+
+    while (first < shard->num_hits) {
+      size_t line_no = shard->hits[first * stride];
+      size_t last = first + 1;
+
+      while (last < shard->num_hits && shard->hits[last * stride] == line_no)
+        last++;
+
+      str_buffer_t **line = txt_buffer_at(buffer, line_no);
+
+      line_nos[num_lines] = line_no;
+      old_lines[num_lines] = *line;
+      new_lines[num_lines] = regex_substitute_matches(
+          re, *line, replace, &shard->hits[first * stride + 1], last - first,
+          stride);
+      *line = new_lines[num_lines++];
+      first = last;
+    }
+  }
+
+  edit_free_shards(shards, num_shards);
+  return command_new_substitute_lines(buffer, line_nos, old_lines, new_lines,
+                                      num_lines);
 }
@@ -4,16 +4,47 @@
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/types.h>
 #include <termios.h>
 #include <uchar.h>
 #include <unistd.h>
 
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
 #define VALIDATE_U32_RANGE(chr)                                                \
   ((chr >= 0 && chr <= 0x10FFFF) && !(chr >= 0xD800 && chr <= 0xDFFF))
 #define VALIDATE_U32_ENDIANNESS(bom) (bom == 0x0000FEFF)
+#define INPUT_RING_CHARS 65536
+#define OUTPUT_BLOCK_CHARS 16384
+
+typedef struct INPUTRing input_ring_t;
+
+struct INPUTRing {
+  char32_t chars[INPUT_RING_CHARS];
+  uint8_t bytes[INPUT_RING_CHARS];
+  size_t head;
+  size_t count;
+  uint8_t carry[sizeof(char32_t)];
+  size_t carry_length;
+  size_t offset;
+  enum INPUTEncoding {
+    INPUT_UTF32,
+    INPUT_UTF8,
+  } encoding;
+  bool started;
+  bool swapped;
+  bool is_big_endian;
+  bool at_eof;
+};
 
 static struct termios original_terminal_settings;
+static input_ring_t input_ring;
+static uint8_t output_bytes[OUTPUT_BLOCK_CHARS * sizeof(char32_t)];
 
 void save_original_settings(void) {
   if (tcgetattr(STDIN_FILENO, &original_terminal_settings) != 0)
@@ -43,25 +74,332 @@ void setup_terminal(void) {
     errno_raise("tcsetattr");
 }
 
-char32_t read_u32_character(static bool *is_big_endian) {
-  static char32_t chr = -1;
+static int utf8_sequence(const uint8_t *bytes, size_t length, char32_t *chr) {
+  uint8_t lead = bytes[0];
+  uint8_t low = 0x80, high = 0xBF;
+  size_t need;
+  char32_t cp;
+
+  if (lead < 0x80) {
+    *chr = lead;
+    return 1;
+  } else if (lead >= 0xC2 && lead <= 0xDF) {
+    need = 2;
+    cp = lead & 0x1F;
+  } else if (lead >= 0xE0 && lead <= 0xEF) {
+    need = 3;
+    cp = lead & 0x0F;
+    low = lead == 0xE0 ? 0xA0 : low;
+    high = lead == 0xED ? 0x9F : high;
+  } else if (lead >= 0xF0 && lead <= 0xF4) {
+    need = 4;
+    cp = lead & 0x07;
+    low = lead == 0xF0 ? 0x90 : low;
+    high = lead == 0xF4 ? 0x8F : high;
+  } else {
+    return 0;
+  }
 
-  if (chr == -1) {
-    if (read(STDIN_FILENO, sizeof(char32_t), &chr) != sizeof(char32_t))
+  // The tighter bounds on the first continuation byte reject overlong
+  // forms, surrogates and code points past U+10FFFF.
+  for (size_t i = 1; i < need; i++) {
+    if (i == length)
       return -1;
+    if (bytes[i] < low || bytes[i] > high)
+      return 0;
+
+    low = 0x80;
+    high = 0xBF;
+    cp = (cp << 6) | (bytes[i] & 0x3F);
+  }
+
+  *chr = cp;
+  return need;
+}
+
+bool utf8_decode(const uint8_t *bytes, size_t length, char32_t *out,
+                 size_t *written, size_t *consumed) {
+  size_t pos = 0, count = 0;
+
+  while (pos < length) {
+#if defined(__AVX2__)
+    for (; pos + 32 <= length; pos += 32, count += 32) {
+      __m256i block = _mm256_loadu_si256((const __m256i *)&bytes[pos]);
+
+      if (_mm256_movemask_epi8(block) != 0)
+        break;
+
+      for (int i = 0; i < 4; i++)
+        _mm256_storeu_si256(
+            (__m256i *)&out[count + i * 8],
+            _mm256_cvtepu8_epi32(
+                _mm_loadl_epi64((const __m128i *)&bytes[pos + i * 8])));
+    }
+#elif defined(__SSE2__)
+    __m128i zero = _mm_setzero_si128();
+
+    for (; pos + 16 <= length; pos += 16, count += 16) {
+      __m128i block = _mm_loadu_si128((const __m128i *)&bytes[pos]);
+
+      if (_mm_movemask_epi8(block) != 0)
+        break;
+
+      __m128i low = _mm_unpacklo_epi8(block, zero);
+      __m128i high = _mm_unpackhi_epi8(block, zero);
+
+      _mm_storeu_si128((__m128i *)&out[count], _mm_unpacklo_epi16(low, zero));
+      _mm_storeu_si128((__m128i *)&out[count + 4],
+                       _mm_unpackhi_epi16(low, zero));
+      _mm_storeu_si128((__m128i *)&out[count + 8],
+                       _mm_unpacklo_epi16(high, zero));
+      _mm_storeu_si128((__m128i *)&out[count + 12],
+                       _mm_unpackhi_epi16(high, zero));
+    }
+#endif
+
+    // Outside ASCII runs, decode one sequence at a time until the next
+    // vector-sized block of ASCII.
+    for (size_t run = 0; pos < length && run < 32; run++) {
+      int used = utf8_sequence(&bytes[pos], length - pos, &out[count]);
+
+      if (used <= 0) {
+        *written = count;
+        *consumed = pos;
+        return used < 0;
+      }
+
+      pos += used;
+      count++;
+    }
+  }
+
+  *written = count;
+  *consumed = pos;
+  return true;
+}
 
-    if (chr != 0x0000FEFF || chr != 0xFFFE0000)
-      return chr;
+size_t utf8_encode(const char32_t *text, size_t length, uint8_t *out) {
+  size_t pos = 0, count = 0;
 
-    *is_big_endian = VALIDATE_U32_ENDIANNESS(chr);
+  while (pos < length) {
+#if defined(__SSE2__)
+    __m128i ascii = _mm_set1_epi32(0x7F);
+
+    for (; pos + 8 <= length; pos += 8, count += 8) {
+      __m128i low = _mm_loadu_si128((const __m128i *)&text[pos]);
+      __m128i high = _mm_loadu_si128((const __m128i *)&text[pos + 4]);
+
+      if (_mm_movemask_epi8(
+              _mm_cmpgt_epi32(_mm_or_si128(low, high), ascii)) != 0)
+        break;
+
+      __m128i words = _mm_packs_epi32(low, high);
+      _mm_storel_epi64((__m128i *)&out[count], _mm_packus_epi16(words, words));
+    }
+#endif
+
+    for (size_t run = 0; pos < length && run < 8; run++) {
+      char32_t chr = text[pos++];
+
+      if (chr < 0x80) {
+        out[count++] = chr;
+      } else if (chr < 0x800) {
+        out[count++] = 0xC0 | (chr >> 6);
+        out[count++] = 0x80 | (chr & 0x3F);
+      } else if (chr < 0x10000) {
+        out[count++] = 0xE0 | (chr >> 12);
+        out[count++] = 0x80 | ((chr >> 6) & 0x3F);
+        out[count++] = 0x80 | (chr & 0x3F);
+      } else {
+        out[count++] = 0xF0 | (chr >> 18);
+        out[count++] = 0x80 | ((chr >> 12) & 0x3F);
+        out[count++] = 0x80 | ((chr >> 6) & 0x3F);
+        out[count++] = 0x80 | (chr & 0x3F);
+      }
+    }
   }
 
-  if (read(STDIN_FILENO, sizeof(char32_t), &chr) != sizeof(char32_t))
-    return -1;
+  return count;
+}
+
+static void input_raise(const char *encoding, size_t offset) {
+  static char message[64];
+
+  snprintf(message, sizeof(message), "Invalid %s input at byte %zu", encoding,
+           offset);
+  raise(message);
+}
+
+static ssize_t input_ring_read(input_ring_t *ring, uint8_t *bytes,
+                               size_t size) {
+  ssize_t got;
+
+  // A character split across two reads is carried over as raw bytes and
+  // completed at the front of the next block.
+  memcpy(bytes, ring->carry, ring->carry_length);
+
+  do
+    got = read(STDIN_FILENO, bytes + ring->carry_length,
+               size - ring->carry_length);
+  while (got < 0 && errno == EINTR);
 
-  if (!VALIDATE_U32_RANGE(chr))
-    errno_raise("Invalid character input");
+  if (got < 0)
+    errno_raise("read");
 
+  if (got == 0)
+    ring->at_eof = true;
+
+  return got;
+}
+
+static size_t input_ring_fill_utf32(input_ring_t *ring, char32_t *block,
+                                    size_t space) {
+  uint8_t *bytes = (uint8_t *)block;
+  ssize_t got = input_ring_read(ring, bytes, space * sizeof(char32_t));
+
+  if (got == 0)
+    return 0;
+
+  size_t total = ring->carry_length + got;
+  size_t length = total / sizeof(char32_t);
+  size_t offset = ring->offset;
+
+  ring->carry_length = total % sizeof(char32_t);
+  memcpy(ring->carry, &bytes[length * sizeof(char32_t)], ring->carry_length);
+  ring->offset += length * sizeof(char32_t);
+
+  if (!ring->started && length > 0 &&
+      (block[0] == 0x0000FEFF || block[0] == 0xFFFE0000)) {
+    ring->is_big_endian = VALIDATE_U32_ENDIANNESS(block[0]);
+    ring->swapped = block[0] == 0xFFFE0000;
+  }
+
+  for (size_t i = 0; i < length; i++) {
+    if (ring->swapped)
+      block[i] = __builtin_bswap32(block[i]);
+    if (!VALIDATE_U32_RANGE(block[i]))
+      input_raise("UTF-32", offset + i * sizeof(char32_t));
+  }
+
+  return length;
+}
+
+static size_t input_ring_fill_utf8(input_ring_t *ring, char32_t *block,
+                                   size_t space) {
+  // Every byte decodes to at most one character, so a read no larger than
+  // the free space can never overflow the ring.
+  if (space > sizeof(ring->bytes))
+    space = sizeof(ring->bytes);
+
+  ssize_t got = input_ring_read(ring, ring->bytes, space);
+
+  if (got == 0) {
+    if (ring->carry_length > 0)
+      input_raise("UTF-8", ring->offset);
+    return 0;
+  }
+
+  size_t total = ring->carry_length + got;
+  size_t length, consumed;
+
+  if (!utf8_decode(ring->bytes, total, block, &length, &consumed))
+    input_raise("UTF-8", ring->offset + consumed);
+
+  ring->carry_length = total - consumed;
+  memcpy(ring->carry, &ring->bytes[consumed], ring->carry_length);
+  ring->offset += consumed;
+  return length;
+}
+
+static bool input_ring_fill(input_ring_t *ring) {
+  if (ring->at_eof)
+    return false;
+
+  if (ring->count == 0)
+    ring->head = 0;
+
+  size_t tail = (ring->head + ring->count) % INPUT_RING_CHARS;
+  size_t space = tail >= ring->head && ring->count < INPUT_RING_CHARS
+                     ? INPUT_RING_CHARS - tail
+                     : ring->head - tail;
+
+  if (space <= ring->carry_length)
+    return true;
+
+  char32_t *block = &ring->chars[tail];
+  size_t length = ring->encoding == INPUT_UTF8
+                      ? input_ring_fill_utf8(ring, block, space)
+                      : input_ring_fill_utf32(ring, block, space);
+
+  if (ring->at_eof)
+    return false;
+
+  // The BOM is looked at once per stream; both encodings decode it to
+  // U+FEFF, and it is dropped rather than handed to the reader.
+  if (!ring->started && length > 0) {
+    ring->started = true;
+
+    if (block[0] == 0xFEFF) {
+      ring->head++;
+      length--;
+    }
+  }
+
+  ring->count += length;
+  return true;
+}
+
+void set_input_encoding(enum INPUTEncoding encoding) {
+  input_ring.encoding = encoding;
+}
+
+// How the text read so far was encoded, for the tab it is loaded into so that
+// a save writes it back the same way.
+enum TABEncoding input_source_encoding(void) {
+  if (input_ring.encoding == INPUT_UTF8)
+    return ENCODING_Utf8;
+
+  return input_ring.swapped ? ENCODING_Utf32Swapped : ENCODING_Utf32;
+}
+
+const char32_t *read_u32_span(bool *is_big_endian, size_t *length) {
+  input_ring_t *ring = &input_ring;
+
+  while (ring->count == 0)
+    if (!input_ring_fill(ring))
+      return NULL;
+
+  *is_big_endian = ring->is_big_endian;
+
+  // Spans never wrap, and stop just after the first newline so a line can
+  // be taken from the ring without scanning it twice.
+  size_t run = INPUT_RING_CHARS - ring->head;
+
+  if (run > ring->count)
+    run = ring->count;
+
+  const char32_t *span = &ring->chars[ring->head];
+  size_t newline = u32_find_char(span, run, U'\n');
+
+  *length = newline < run ? newline + 1 : run;
+  ring->head = (ring->head + *length) % INPUT_RING_CHARS;
+  ring->count -= *length;
+  return span;
+}
+
+char32_t read_u32_character(bool *is_big_endian) {
+  input_ring_t *ring = &input_ring;
+
+  while (ring->count == 0)
+    if (!input_ring_fill(ring))
+      return -1;
+
+  *is_big_endian = ring->is_big_endian;
+
+  char32_t chr = ring->chars[ring->head];
+
+  ring->head = (ring->head + 1) % INPUT_RING_CHARS;
+  ring->count--;
   return chr;
 }
 
@@ -79,3 +417,30 @@ void convert_u32_to_byte_sequence(char32_t chr, uint8_t byte_seq[static 4],
     byte_seq[0] = chr & 0xFF;
   }
 }
+
+// Encodes through one static block, so only the editing thread may call it.
+// It backs terminal output; saves run utf8_encode on their writer thread.
+void write_u32_span(int fd, const char32_t *text, size_t length) {
+  while (length > 0) {
+    size_t block = length < OUTPUT_BLOCK_CHARS ? length : OUTPUT_BLOCK_CHARS;
+    size_t size = utf8_encode(text, block, output_bytes);
+
+    for (size_t done = 0; done < size;) {
+      ssize_t put = write(fd, &output_bytes[done], size - done);
+
+      if (put < 0 && errno == EINTR)
+        continue;
+      if (put < 0)
+        errno_raise("write");
+
+      done += put;
+    }
+
+    text += block;
+    length -= block;
+  }
+}
+
+void write_terminal(const char32_t *text, size_t length) {
+  write_u32_span(STDOUT_FILENO, text, length);
+}
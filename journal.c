@@ -0,0 +1,618 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define JOURNAL_MAGIC "CHEDJRN1"
+#define JOURNAL_MAGIC_LENGTH 8
+#define JOURNAL_SUFFIX ".journal"
+#define JOURNAL_TEMP_SUFFIX ".XXXXXX"
+#define JOURNAL_FRAME_SIZE (2 * sizeof(uint32_t))
+#define JOURNAL_BUFFER_INIT_CAP 65536
+
+typedef struct Journal journal_t;
+typedef bool (*journal_record_fn)(const uint8_t *payload, size_t length,
+                                  void *ctx);
+
+struct Journal {
+  char *path;
+  int fd;
+  pthread_mutex_t lock;
+  pthread_cond_t wake;
+  pthread_cond_t idle;
+  pthread_t flusher;
+  uint8_t *pending;
+  size_t pending_length;
+  size_t pending_capacity;
+  uint8_t *writing;
+  size_t writing_capacity;
+  size_t base;
+  size_t end;
+  size_t save_mark;
+  bool saving;
+  bool flushing;
+  bool stopping;
+  const char *failed_call;
+  int error;
+};
+
+size_t journal_put_varint(uint8_t *out, uint64_t value) {
+  size_t length = 0;
+
+  while (value >= 0x80) {
+    out[length++] = (value & 0x7F) | 0x80;
+    value >>= 7;
+  }
+
+  out[length++] = value;
+  return length;
+}
+
+bool journal_get_varint(const uint8_t **cursor, const uint8_t *end,
+                        uint64_t *value) {
+  uint64_t result = 0;
+
+  for (unsigned shift = 0; shift < 64 && *cursor < end; shift += 7) {
+    uint8_t byte = *(*cursor)++;
+
+    result |= (uint64_t)(byte & 0x7F) << shift;
+
+    if ((byte & 0x80) == 0) {
+      *value = result;
+      return true;
+    }
+  }
+
+  return false;
+}
+
+static uint32_t journal_checksum(const uint8_t *payload, size_t length) {
+  uint32_t hash = 2166136261u;
+
+  for (size_t i = 0; i < length; i++) {
+    hash ^= payload[i];
+    hash *= 16777619u;
+  }
+
+  return hash;
+}
+
+static char *journal_path(const char *document_path) {
+  size_t length = strlen(document_path);
+  char *path = malloc(length + sizeof(JOURNAL_SUFFIX));
+
+  if (path == NULL)
+    raise("Memory allocation error");
+
+  memcpy(path, document_path, length);
+  memcpy(&path[length], JOURNAL_SUFFIX, sizeof(JOURNAL_SUFFIX));
+  return path;
+}
+
+static bool journal_write_all(int fd, const uint8_t *bytes, size_t length,
+                              off_t offset) {
+  while (length > 0) {
+    ssize_t put = pwrite(fd, bytes, length, offset);
+
+    if (put < 0 && errno == EINTR)
+      continue;
+    if (put < 0)
+      return false;
+
+    bytes += put;
+    length -= put;
+    offset += put;
+  }
+
+  return true;
+}
+
+// Walks the framed records of a journal image and returns the offset just
+// past the last intact one; a torn or corrupt tail is where a crash hit.
+static size_t journal_scan(const uint8_t *image, size_t size,
+                           journal_record_fn fn, void *ctx, size_t *count) {
+  size_t offset = JOURNAL_MAGIC_LENGTH;
+
+  *count = 0;
+
+  while (offset + JOURNAL_FRAME_SIZE <= size) {
+    uint32_t length, checksum;
+
+    memcpy(&length, &image[offset], sizeof(uint32_t));
+    memcpy(&checksum, &image[offset + sizeof(uint32_t)], sizeof(uint32_t));
+
+    const uint8_t *payload = &image[offset + JOURNAL_FRAME_SIZE];
+
+    if (length > size - offset - JOURNAL_FRAME_SIZE ||
+        journal_checksum(payload, length) != checksum)
+      break;
+
+    if (fn != NULL && !fn(payload, length, ctx))
+      break;
+
+    offset += JOURNAL_FRAME_SIZE + length;
+    (*count)++;
+  }
+
+  return offset;
+}
+
+static uint8_t *journal_read_image(int fd, size_t *size) {
+  struct stat info;
+
+  if (fstat(fd, &info) != 0)
+    errno_raise("fstat");
+
+  uint8_t *image = malloc(info.st_size > 0 ? info.st_size : 1);
+
+  if (image == NULL)
+    raise("Memory allocation error");
+
+  size_t done = 0;
+
+  while (done < (size_t)info.st_size) {
+    ssize_t got = pread(fd, &image[done], info.st_size - done, done);
+
+    if (got < 0 && errno == EINTR)
+      continue;
+    if (got < 0)
+      errno_raise("pread");
+    if (got == 0)
+      break;
+
+    done += got;
+  }
+
+  *size = done;
+  return image;
+}
+
+size_t journal_replay(const char *document_path, journal_record_fn fn,
+                      void *ctx) {
+  char *path = journal_path(document_path);
+  int fd = open(path, O_RDWR);
+
+  free(path);
+
+  if (fd < 0) {
+    if (errno == ENOENT)
+      return 0;
+    errno_raise("open");
+  }
+
+  size_t size, count = 0;
+  uint8_t *image = journal_read_image(fd, &size);
+
+  // Records after one that fails to apply were written against a text that
+  // replay never reaches, so the journal is cut at the first failure.
+  if (size >= JOURNAL_MAGIC_LENGTH &&
+      memcmp(image, JOURNAL_MAGIC, JOURNAL_MAGIC_LENGTH) == 0) {
+    size_t end = journal_scan(image, size, fn, ctx, &count);
+
+    if (end < size && ftruncate(fd, end) != 0)
+      errno_raise("ftruncate");
+  }
+
+  free(image);
+  close(fd);
+  return count;
+}
+
+// Puts a batch that did not go out whole back in front of the queue. The
+// retry writes it at the same offset, over whatever part did reach the file,
+// so no record is ever lost from the middle.
+static void journal_requeue(journal_t *journal, size_t batch_length) {
+  size_t length = batch_length + journal->pending_length;
+
+  if (length > journal->writing_capacity) {
+    uint8_t *writing = realloc(journal->writing, length);
+
+    // Without room to merge, the batch is dropped and only the write error
+    // reaches the editing thread.
+    if (writing == NULL)
+      return;
+
+    journal->writing = writing;
+    journal->writing_capacity = length;
+  }
+
+  memcpy(&journal->writing[batch_length], journal->pending,
+         journal->pending_length);
+
+  uint8_t *pending = journal->pending;
+  size_t pending_capacity = journal->pending_capacity;
+
+  journal->pending = journal->writing;
+  journal->pending_capacity = journal->writing_capacity;
+  journal->pending_length = length;
+  journal->writing = pending;
+  journal->writing_capacity = pending_capacity;
+}
+
+static void *journal_flush_loop(void *arg) {
+  journal_t *journal = arg;
+
+  pthread_mutex_lock(&journal->lock);
+
+  // Group commit: whatever was appended since the last pass goes out in one
+  // write and one fdatasync, off the editing thread. After a failure nothing
+  // more is written until the editing thread has been told.
+  while (true) {
+    if (journal->pending_length == 0 || journal->error != 0) {
+      if (journal->stopping)
+        break;
+
+      pthread_cond_wait(&journal->wake, &journal->lock);
+      continue;
+    }
+
+    off_t offset = JOURNAL_MAGIC_LENGTH + journal->end - journal->base -
+                   journal->pending_length;
+    uint8_t *batch = journal->pending;
+    size_t batch_length = journal->pending_length;
+    size_t batch_capacity = journal->pending_capacity;
+
+    journal->pending = journal->writing;
+    journal->pending_capacity = journal->writing_capacity;
+    journal->pending_length = 0;
+    journal->writing = batch;
+    journal->writing_capacity = batch_capacity;
+    journal->flushing = true;
+
+    pthread_mutex_unlock(&journal->lock);
+
+    const char *failed_call = NULL;
+    bool torn = false;
+
+    if (!journal_write_all(journal->fd, batch, batch_length, offset)) {
+      failed_call = "write";
+      torn = true;
+    } else if (fdatasync(journal->fd) != 0) {
+      failed_call = "fdatasync";
+    }
+
+    int error = errno;
+
+    pthread_mutex_lock(&journal->lock);
+
+    if (torn)
+      journal_requeue(journal, batch_length);
+
+    if (failed_call != NULL) {
+      journal->failed_call = failed_call;
+      journal->error = error;
+    }
+
+    journal->flushing = false;
+    pthread_cond_broadcast(&journal->idle);
+  }
+
+  pthread_mutex_unlock(&journal->lock);
+  return NULL;
+}
+
+journal_t *journal_open(const char *document_path) {
+  char *path = journal_path(document_path);
+  int fd = open(path, O_RDWR | O_CREAT, 0600);
+
+  if (fd < 0)
+    errno_raise("open");
+
+  size_t size, count;
+  uint8_t *image = journal_read_image(fd, &size);
+  size_t end = JOURNAL_MAGIC_LENGTH;
+
+  if (size >= JOURNAL_MAGIC_LENGTH &&
+      memcmp(image, JOURNAL_MAGIC, JOURNAL_MAGIC_LENGTH) == 0)
+    end = journal_scan(image, size, NULL, NULL, &count);
+  else if (pwrite(fd, JOURNAL_MAGIC, JOURNAL_MAGIC_LENGTH, 0) !=
+           JOURNAL_MAGIC_LENGTH)
+    errno_raise("pwrite");
+
+  free(image);
+
+  // Drop any torn tail so new records follow the last intact one.
+  if (ftruncate(fd, end) != 0 || lseek(fd, end, SEEK_SET) < 0)
+    errno_raise("ftruncate");
+
+  journal_t *journal = malloc(sizeof(journal_t));
+
+  if (journal == NULL)
+    raise("Memory allocation error");
+
+  journal->path = path;
+  journal->fd = fd;
+  journal->pending = malloc(JOURNAL_BUFFER_INIT_CAP);
+  journal->pending_length = 0;
+  journal->pending_capacity = JOURNAL_BUFFER_INIT_CAP;
+  journal->writing = malloc(JOURNAL_BUFFER_INIT_CAP);
+  journal->writing_capacity = JOURNAL_BUFFER_INIT_CAP;
+  journal->base = 0;
+  journal->end = end - JOURNAL_MAGIC_LENGTH;
+  journal->save_mark = 0;
+  journal->saving = false;
+  journal->flushing = false;
+  journal->stopping = false;
+  journal->failed_call = NULL;
+  journal->error = 0;
+
+  if (journal->pending == NULL || journal->writing == NULL)
+    raise("Memory allocation error");
+
+  pthread_mutex_init(&journal->lock, NULL);
+  pthread_cond_init(&journal->wake, NULL);
+  pthread_cond_init(&journal->idle, NULL);
+
+  if (pthread_create(&journal->flusher, NULL, journal_flush_loop, journal) !=
+      0)
+    raise("Journal thread creation error");
+
+  return journal;
+}
+
+// Hands a failure of the flusher back to the editing thread. Called with the
+// lock held, which it drops before raising.
+static void journal_check(journal_t *journal) {
+  if (journal->error == 0)
+    return;
+
+  const char *failed_call = journal->failed_call;
+  int error = journal->error;
+
+  journal->failed_call = NULL;
+  journal->error = 0;
+  pthread_cond_signal(&journal->wake);
+  pthread_mutex_unlock(&journal->lock);
+
+  errno = error;
+  errno_raise(failed_call);
+}
+
+void journal_append(journal_t *journal, const uint8_t *payload,
+                    size_t length) {
+  uint32_t frame[2] = {length, journal_checksum(payload, length)};
+  size_t needed = JOURNAL_FRAME_SIZE + length;
+
+  pthread_mutex_lock(&journal->lock);
+
+  if (journal->pending_length + needed > journal->pending_capacity) {
+    size_t capacity = journal->pending_capacity * 2;
+
+    if (capacity < journal->pending_length + needed)
+      capacity = journal->pending_length + needed;
+
+    uint8_t *pending = realloc(journal->pending, capacity);
+
+    if (pending == NULL) {
+      pthread_mutex_unlock(&journal->lock);
+      raise("Memory allocation error");
+    }
+
+    journal->pending = pending;
+    journal->pending_capacity = capacity;
+  }
+
+  memcpy(&journal->pending[journal->pending_length], frame,
+         JOURNAL_FRAME_SIZE);
+  memcpy(&journal->pending[journal->pending_length + JOURNAL_FRAME_SIZE],
+         payload, length);
+  journal->pending_length += needed;
+  journal->end += needed;
+
+  pthread_cond_signal(&journal->wake);
+  journal_check(journal);
+  pthread_mutex_unlock(&journal->lock);
+}
+
+// Marks count bytes appended since the journal was opened, not file offsets,
+// so a mark still names the same record after journal_reset has dropped the
+// ones before it.
+size_t journal_mark(journal_t *journal) {
+  pthread_mutex_lock(&journal->lock);
+
+  size_t end = journal->end;
+
+  pthread_mutex_unlock(&journal->lock);
+  return end;
+}
+
+// Drops every record after mark. A mark before the journal's first record
+// cannot be reached by cutting, and false is returned. Neither can one before
+// a pending save's snapshot: the saved file would still hold the cut edits.
+bool journal_rewind(journal_t *journal, size_t mark) {
+  pthread_mutex_lock(&journal->lock);
+
+  while (journal->flushing)
+    pthread_cond_wait(&journal->idle, &journal->lock);
+
+  if (mark < journal->base || mark > journal->end ||
+      (journal->saving && mark < journal->save_mark)) {
+    journal_check(journal);
+    pthread_mutex_unlock(&journal->lock);
+    return false;
+  }
+
+  size_t written = journal->end - journal->pending_length;
+
+  if (mark >= written) {
+    journal->pending_length = mark - written;
+  } else {
+    off_t offset = JOURNAL_MAGIC_LENGTH + mark - journal->base;
+
+    journal->pending_length = 0;
+
+    if (ftruncate(journal->fd, offset) != 0) {
+      pthread_mutex_unlock(&journal->lock);
+      errno_raise("ftruncate");
+    }
+  }
+
+  journal->end = mark;
+  journal_check(journal);
+  pthread_mutex_unlock(&journal->lock);
+  return true;
+}
+
+// Copies the on-disk records in [from, to) to a fresh journal and renames it
+// over the old one, so a crash part way leaves one or the other whole.
+static const char *journal_rebase(journal_t *journal, off_t from, off_t to) {
+  size_t length = to - from, path_length = strlen(journal->path);
+  uint8_t *image = malloc(JOURNAL_MAGIC_LENGTH + length);
+  char *temp_path = malloc(path_length + sizeof(JOURNAL_TEMP_SUFFIX));
+
+  if (image == NULL || temp_path == NULL)
+    raise("Memory allocation error");
+
+  memcpy(image, JOURNAL_MAGIC, JOURNAL_MAGIC_LENGTH);
+  memcpy(temp_path, journal->path, path_length);
+  memcpy(&temp_path[path_length], JOURNAL_TEMP_SUFFIX,
+         sizeof(JOURNAL_TEMP_SUFFIX));
+
+  const char *failed_call = NULL;
+  int fd = -1;
+
+  for (size_t done = 0; failed_call == NULL && done < length;) {
+    ssize_t got = pread(journal->fd, &image[JOURNAL_MAGIC_LENGTH + done],
+                        length - done, from + done);
+
+    if (got < 0 && errno == EINTR)
+      continue;
+    if (got <= 0)
+      failed_call = "pread";
+    else
+      done += got;
+  }
+
+  if (failed_call == NULL && (fd = mkstemp(temp_path)) < 0)
+    failed_call = "mkstemp";
+  if (failed_call == NULL &&
+      !journal_write_all(fd, image, JOURNAL_MAGIC_LENGTH + length, 0))
+    failed_call = "write";
+  if (failed_call == NULL && fdatasync(fd) != 0)
+    failed_call = "fdatasync";
+  if (failed_call == NULL && rename(temp_path, journal->path) != 0)
+    failed_call = "rename";
+
+  int error = errno;
+
+  if (failed_call != NULL && fd >= 0) {
+    unlink(temp_path);
+    close(fd);
+  } else if (failed_call == NULL) {
+    close(journal->fd);
+    journal->fd = fd;
+  }
+
+  free(image);
+  free(temp_path);
+  errno = error;
+  return failed_call;
+}
+
+// Taken when a save snapshots the text: records appended from here on are
+// edits the saved file will not hold.
+void journal_begin_save(journal_t *journal) {
+  pthread_mutex_lock(&journal->lock);
+  journal->save_mark = journal->end;
+  journal->saving = true;
+  pthread_mutex_unlock(&journal->lock);
+}
+
+// Once the file is saved, only the records before the snapshot are dropped;
+// edits made while the writer ran stay journaled.
+void journal_end_save(journal_t *journal, bool saved) {
+  pthread_mutex_lock(&journal->lock);
+
+  while (journal->flushing)
+    pthread_cond_wait(&journal->idle, &journal->lock);
+
+  size_t mark = journal->save_mark;
+
+  journal->saving = false;
+
+  if (!saved || mark <= journal->base) {
+    pthread_mutex_unlock(&journal->lock);
+    return;
+  }
+
+  size_t written = journal->end - journal->pending_length;
+  const char *failed_call = NULL;
+
+  if (mark >= written) {
+    size_t drop = mark - written;
+
+    memmove(journal->pending, &journal->pending[drop],
+            journal->pending_length - drop);
+    journal->pending_length -= drop;
+
+    if (ftruncate(journal->fd, JOURNAL_MAGIC_LENGTH) != 0)
+      failed_call = "ftruncate";
+  } else {
+    failed_call = journal_rebase(
+        journal, JOURNAL_MAGIC_LENGTH + mark - journal->base,
+        JOURNAL_MAGIC_LENGTH + written - journal->base);
+  }
+
+  if (failed_call != NULL) {
+    pthread_mutex_unlock(&journal->lock);
+    errno_raise(failed_call);
+  }
+
+  journal->base = mark;
+  pthread_mutex_unlock(&journal->lock);
+}
+
+void journal_close(journal_t *journal) {
+  pthread_mutex_lock(&journal->lock);
+  journal->stopping = true;
+  pthread_cond_signal(&journal->wake);
+  pthread_mutex_unlock(&journal->lock);
+
+  pthread_join(journal->flusher, NULL);
+
+  const char *failed_call = journal->failed_call;
+  int error = journal->error;
+
+  close(journal->fd);
+  free(journal->path);
+  pthread_mutex_destroy(&journal->lock);
+  pthread_cond_destroy(&journal->wake);
+  pthread_cond_destroy(&journal->idle);
+  free(journal->pending);
+  free(journal->writing);
+  free(journal);
+
+  if (error != 0) {
+    errno = error;
+    errno_raise(failed_call);
+  }
+}
+
+// Drops every record, for when the whole text is about to be journaled or
+// saved synchronously.
+void journal_reset(journal_t *journal) {
+  pthread_mutex_lock(&journal->lock);
+
+  while (journal->flushing)
+    pthread_cond_wait(&journal->idle, &journal->lock);
+
+  // Queued records go too, along with any batch the flusher failed to write.
+  journal->pending_length = 0;
+  journal->base = journal->end;
+  journal->failed_call = NULL;
+  journal->error = 0;
+
+  if (ftruncate(journal->fd, JOURNAL_MAGIC_LENGTH) != 0 ||
+      lseek(journal->fd, JOURNAL_MAGIC_LENGTH, SEEK_SET) < 0) {
+    pthread_mutex_unlock(&journal->lock);
+    errno_raise("ftruncate");
+  }
+
+  pthread_mutex_unlock(&journal->lock);
+}
@@ -1,351 +1,323 @@
 #include <limits.h>
+#include <stddef.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <uchar.h>
 
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
 #define EPSILON_TRANS -1
+#define NO_STATE -1
+#define NFA_MAX_EPS_TRANS 2
+#define NO_SLOT -1
+
+#define REGEX_GROUP_BASE 0x110000
+#define REGEX_IS_GROUP(chr) ((chr) >= REGEX_GROUP_BASE)
 
 extern Arena *current_arena;
 
 typedef struct NFATrans nfa_trans_t;
 typedef struct NFAState nfa_state_t;
+typedef struct NFAStateSet nfa_state_set_t;
 typedef struct NFAMain nfa_main_t;
+typedef struct NFAProg nfa_prog_t;
 typedef struct RETree regex_tree_t;
 
 struct NFATrans {
   char32_t symbol;
-  nfa_state_t *target;
-  struct NFATrans *next;
-  struct NFATrans *prev;
+  int target;
 };
 
 struct NFAState {
   int id;
   bool is_accepting;
-  nfa_trans_t *trans;
-  nfa_trans_t *eps_trans;
-  struct NFAState *next;
-  struct NFAState *prev;
+  nfa_trans_t trans;
+  nfa_trans_t eps_trans[NFA_MAX_EPS_TRANS];
+  int num_eps_trans;
+  int save_slot;
+  int *closure;
+  size_t closure_length;
+};
+
+struct NFAStateSet {
+  int *dense;
+  size_t *sparse;
+  size_t length;
+  size_t capacity;
 };
 
 struct NFAMain {
-  nfa_state_t *start_state;
-  nfa_state_t *accept_state;
+  int start_state;
+  int accept_state;
+};
+
+struct NFAProg {
+  Arena *arena;
   nfa_state_t *states;
-  struct NFAMain *next;
-  struct NFAMain *prev;
+  size_t num_states;
+  size_t max_states;
+  size_t num_slots;
+  int start_state;
+  int accept_state;
 };
 
-static int state_id_counter = 0;
+static void *regex_request(Arena *arena, size_t size) {
+  void *memory = request_memory(arena, size);
 
-nfa_state_t *nfa_state_new(bool is_accepting) {
-  nfa_state_t *state = request_memory(current_arena, sizeof(nfa_state_t));
-  state->id = state_id_counter++;
-  state->is_accepting = is_accepting;
-  state->trans = NULL;
-  state->next = NULL;
-  state->prev = NULL;
-}
+  if (memory == NULL)
+    raise("Memory allocation error");
 
-bool nfa_state_list_empty(nfa_state_t **list) {
-  if (list == NULL || *list == NULL)
-    return true;
-  return false;
+  return memory;
 }
 
-nfa_state_t *nfa_state_add_transition(nfa_state_t *state, char32_t symbol,
-                                      nfa_state_t *target) {
-  nfa_trans_list_append(&state->trans, nfa_trans_new(symbol, target));
+static void *regex_duplicate(Arena *arena, const void *source, size_t size) {
+  void *memory = regex_request(arena, size);
+  memcpy(memory, source, size);
+  return memory;
 }
 
-nfa_state_t *nfa_state_add_eps_transition(nfa_state_t *state,
-                                          nfa_state_t *target) {
-  nfa_trans_list_append(&state->eps_trans,
-                        nfa_trans_new(EPSILON_TRANS, target));
+nfa_prog_t *nfa_prog_new(Arena *arena, size_t max_states) {
+  nfa_prog_t *prog = regex_request(arena, sizeof(nfa_prog_t));
+
+  prog->arena = arena;
+  prog->states = regex_request(arena, max_states * sizeof(nfa_state_t));
+  prog->num_states = 0;
+  prog->max_states = max_states;
+  prog->num_slots = 2;
+  prog->start_state = NO_STATE;
+  prog->accept_state = NO_STATE;
+  return prog;
 }
 
-nfa_state_t *nfa_state_list_append(nfa_state_t **list, nfa_state_t *state) {
-  if (nfa_state_list_empty(list)) {
-    *list = state;
-    return *list;
-  }
-
-  nfa_state_t *head = *list;
-
-  while (head->next != NULL)
-    head = head->next;
-
-  state->prev = head;
-  head->next = state;
-
-  return state;
+int nfa_state_new(nfa_prog_t *prog) {
+  if (prog->num_states >= prog->max_states)
+    raise("NFA program overflow");
+
+  int id = prog->num_states++;
+  nfa_state_t *state = &prog->states[id];
+  state->id = id;
+  state->is_accepting = false;
+  state->trans.symbol = EPSILON_TRANS;
+  state->trans.target = NO_STATE;
+  state->num_eps_trans = 0;
+  state->save_slot = NO_SLOT;
+  state->closure = NULL;
+  state->closure_length = 0;
+  return id;
 }
 
-nfa_state_t *nfa_state_list_copy(nfa_state_t **list) {
-  if (nfa_state_list_empty(list))
-    return NULL;
-
-  nfa_state_t *head = *list;
-  nfa_state_t *copy_list =
-      duplicate_memory(current_arena, head, sizeof(nfa_state_t));
-
-  head = head->next;
-  while (head != NULL) {
-    nfa_state_t *copy_item =
-        duplicate_memory(current_arena, head, sizeof(nfa_state_t));
-    nfa_state_list_append(&copy_list, copy_item);
-    head = head->next;
-  }
-
-  return copy_list;
+void nfa_state_add_transition(nfa_prog_t *prog, int state, char32_t symbol,
+                              int target) {
+  prog->states[state].trans.symbol = symbol;
+  prog->states[state].trans.target = target;
 }
 
-nfa_state_t *nfa_state_list_pop(nfa_state_t **list) {
-  if (nfa_state_list_empty(list))
-    return NULL;
-
-  nfa_state_t *head = *list;
-
-  while (head->next != NULL)
-    head = head->next;
-
-  if (head->prev != NULL)
-    head->prev->next = NULL;
-  else
-    *list = NULL;
+void nfa_state_add_eps_transition(nfa_prog_t *prog, int state, int target) {
+  nfa_state_t *from = &prog->states[state];
 
-  head->prev = NULL;
+  if (from->num_eps_trans >= NFA_MAX_EPS_TRANS)
+    raise("NFA epsilon transition overflow");
 
-  return head;
+  from->eps_trans[from->num_eps_trans].symbol = EPSILON_TRANS;
+  from->eps_trans[from->num_eps_trans].target = target;
+  from->num_eps_trans++;
 }
 
-bool nfa_state_list_contains(nfa_state_t **list, nfa_state_t state) {
-  if (nfa_state_list_empty(list))
-    return false;
-
-  nfa_state_t *head = *list;
-
-  while (head != NULL) {
-    if (head->id == state->id)
-      return true;
-    head = head->next;
-  }
+nfa_state_set_t *nfa_state_set_new(Arena *arena, size_t capacity) {
+  nfa_state_set_t *set = regex_request(arena, sizeof(nfa_state_set_t));
 
-  return false;
+  set->dense = regex_request(arena, capacity * sizeof(int));
+  set->sparse = regex_request(arena, capacity * sizeof(size_t));
+  set->length = 0;
+  set->capacity = capacity;
+  return set;
 }
 
-nfa_trans_t *nfa_trans_new(char32_t symbol, nfa_state_t *target) {
-  nfa_trans_t *trans = request_memory(current_arena, sizeof(nfa_trans_t));
-  trans->symbol = symbol;
-  trans->target = target;
-  trans->next = NULL;
-  trans->prev = NULL;
-}
+void nfa_state_set_clear(nfa_state_set_t *set) { set->length = 0; }
 
-bool nfa_trans_list_empty(nfa_trans_t **list) {
-  if (list == NULL || *list == NULL)
+bool nfa_state_set_empty(const nfa_state_set_t *set) {
+  if (set == NULL || set->length == 0)
     return true;
   return false;
 }
 
-nfa_trans_t *nfa_trans_list_append(nfa_trans_t **list, nfa_trans_t *trans) {
-  if (nfa_trans_list_empty(list)) {
-    *list = trans;
-    return *list;
-  }
-
-  nfa_trans_t *head = *list;
-
-  while (head->next != NULL)
-    head = head->next;
+bool nfa_state_set_contains(const nfa_state_set_t *set, int state) {
+  size_t index = set->sparse[state];
+  return index < set->length && set->dense[index] == state;
+}
 
-  trans->prev = head;
-  head->next = trans;
+bool nfa_state_set_insert(nfa_state_set_t *set, int state) {
+  if (nfa_state_set_contains(set, state))
+    return false;
 
-  return trans;
+  set->sparse[state] = set->length;
+  set->dense[set->length++] = state;
+  return true;
 }
 
-nfa_trans_t *nfa_trans_list_filter_eps_trans(nfa_trans_t **list) {
-  if (nfa_trans_list_empty(list))
-    return NULL;
-
-  nfa_trans_t *filt_list = NULL;
-  nfa_trans_t *head = *list;
+void epsilon_closure(const nfa_prog_t *prog, nfa_state_set_t *closure) {
+  // The dense array doubles as the work queue: newly inserted states are
+  // appended behind the cursor and visited in turn.
+  for (size_t i = 0; i < closure->length; i++) {
+    const nfa_state_t *state = &prog->states[closure->dense[i]];
 
-  while (head != NULL) {
-    if (head->symbol == EPSILON_TRANS)
-      nfa_trans_list_append(&filt_list, head);
-    head = head->next;
+    for (int j = 0; j < state->num_eps_trans; j++)
+      nfa_state_set_insert(closure, state->eps_trans[j].target);
   }
-
-  return filt_list;
 }
 
-nfa_state_t *epsilon_closure(nfa_state_t **state_list) {
-  nfa_state_t *closure = nfa_state_list_copy(state_list);
-  nfa_state_t *stack = nfa_state_list_copy(state_list);
+void nfa_prog_compute_closures(nfa_prog_t *prog) {
+  Arena *scratch = arena_new();
+  nfa_state_set_t *closure = nfa_state_set_new(scratch, prog->num_states);
 
-  while (!nfa_state_list_empty(&stack)) {
-    nfa_state_t *top = nfa_state_list_pop(&stack);
-    nfa_trans_t *eps_trans = top->eps_trans;
+  for (size_t i = 0; i < prog->num_states; i++) {
+    nfa_state_t *state = &prog->states[i];
+    size_t length = 0;
 
-    while (eps_trans != NULL) {
-      if (!nfa_state_list_contains(&closure, eps_trans->target)) {
-        nfa_state_list_append(&closure, eps_trans->target);
-        nfa_state_list_append(&stack, eps_trans->target);
-      }
+    nfa_state_set_clear(closure);
+    nfa_state_set_insert(closure, state->id);
+    epsilon_closure(prog, closure);
+
+    // Only states that consume a symbol or accept matter after a step, so
+    // pure epsilon states are dropped from the stored closure.
+    for (size_t j = 0; j < closure->length; j++) {
+      const nfa_state_t *member = &prog->states[closure->dense[j]];
 
-      eps_trans = eps_trans->next;
+      if (member->trans.target != NO_STATE || member->is_accepting)
+        closure->dense[length++] = member->id;
     }
+
+    state->closure =
+        regex_duplicate(prog->arena, closure->dense, length * sizeof(int));
+    state->closure_length = length;
   }
 
-  return closure;
+  arena_destroy(scratch);
+}
+
+void nfa_state_set_add_closure(const nfa_prog_t *prog, nfa_state_set_t *set,
+                               int state) {
+  const nfa_state_t *from = &prog->states[state];
+
+  for (size_t i = 0; i < from->closure_length; i++)
+    nfa_state_set_insert(set, from->closure[i]);
 }
 
-bool nfa_simulate_and_match(nfa_main_t *nfa, const char32_t *input,
+bool nfa_simulate_and_match(const nfa_prog_t *prog, const char32_t *input,
                             size_t input_length) {
-  nfa_state_t *current_states = epsilon_closure(nfa->start_state);
+  Arena *scratch = arena_new();
+  nfa_state_set_t *current_states =
+      nfa_state_set_new(scratch, prog->num_states);
+  nfa_state_set_t *next_states = nfa_state_set_new(scratch, prog->num_states);
+  bool matched = false;
 
-  for (size_t i = 0; i < input_length; i++) {
-    nfa_state_t *next_states = NULL;
-    nfa_state_t *head_current = current_states;
+  nfa_state_set_add_closure(prog, current_states, prog->start_state);
 
-    while (head_current != NULL) {
-      nfa_trans_t *head_trans = head_current->trans;
+  for (size_t i = 0; i < input_length; i++) {
+    nfa_state_set_clear(next_states);
 
-      while (head_trans != NULL) {
-        if (head_trans->symbol == input[i])
-          nfa_state_list_append(&next_states, head_trans->target);
+    for (size_t j = 0; j < current_states->length; j++) {
+      const nfa_trans_t *trans = &prog->states[current_states->dense[j]].trans;
 
-        head_trans = head_trans->next;
-      }
+      if (trans->target != NO_STATE && trans->symbol == input[i])
+        nfa_state_set_add_closure(prog, next_states, trans->target);
     }
 
-    head_current = head_current->next;
-    current_states = epsilon_closure(next_states);
+    nfa_state_set_t *swap = current_states;
+    current_states = next_states;
+    next_states = swap;
 
-    if (nfa_state_list_empty(current_states))
-      return false;
+    if (nfa_state_set_empty(current_states))
+      break;
   }
 
-  nfa_state_t *head_current = current_states;
-
-  while (head_current != NULL) {
-    if (head_current->is_accepting)
-      return true;
-
-    return false;
-  }
+  matched = nfa_state_set_contains(current_states, prog->accept_state);
+  arena_destroy(scratch);
+  return matched;
 }
 
-nfa_main_t *nfa_main_new(nfa_state_t *start_state, nfa_state_t *accept_state) {
-  nfa_main_t *nfa = request_memory(current_arena, sizeof(nfa_main_t));
-  nfa->start_state = start_state;
-  nfa->accept_state = accept_state;
-  nfa->states = NULL;
-  nfa->next = NULL;
-  nfa->prev = NULL;
-  nfa_state_list_append(&nfa->states, start_state);
-  nfa_state_list_append(&nfa->states, end_state);
+nfa_main_t nfa_main_new(int start_state, int accept_state) {
+  nfa_main_t nfa;
+  nfa.start_state = start_state;
+  nfa.accept_state = accept_state;
   return nfa;
 }
 
-nfa_main_t *nfa_main_new_literal(char32_t symbol) {
-  nfa_state_t *start_state = nfa_state_new(false);
-  nfa_state_t *accept_state = nfa_state_new(true);
-  nfa_state_add_transiton(start_state, symbol, accept_state);
-  nfa_main_t *nfa = nfa_main_new(start_state, accept_state);
-  return nfa;
+nfa_main_t nfa_main_new_literal(nfa_prog_t *prog, char32_t symbol) {
+  int start_state = nfa_state_new(prog);
+  int accept_state = nfa_state_new(prog);
+  nfa_state_add_transition(prog, start_state, symbol, accept_state);
+  return nfa_main_new(start_state, accept_state);
 }
 
-nfa_main_t *nfa_main_new_union(nfa_main_t *nfa_a, nfa_main_t *nfa_b) {
-  nfa_state_t *new_start_state = nfa_state_new(false);
-  nfa_state_t *new_accept_state = nfa_state_new(true);
+nfa_main_t nfa_main_new_union(nfa_prog_t *prog, nfa_main_t nfa_a,
+                              nfa_main_t nfa_b) {
+  int new_start_state = nfa_state_new(prog);
+  int new_accept_state = nfa_state_new(prog);
 
-  nfa_state_add_eps_transition(new_start_state, nfa_a->start_state);
-  nfa_state_add_eps_transition(new_start_state, nfa_b->start_state);
+  nfa_state_add_eps_transition(prog, new_start_state, nfa_a.start_state);
+  nfa_state_add_eps_transition(prog, new_start_state, nfa_b.start_state);
 
-  nfa_state_add_eps_transition(nfa_a->accept_state, new_accept_state);
-  nfa_state_add_eps_transition(nfa_b->accept_state, new_accept_state);
+  nfa_state_add_eps_transition(prog, nfa_a.accept_state, new_accept_state);
+  nfa_state_add_eps_transition(prog, nfa_b.accept_state, new_accept_state);
 
-  nfa_main_t *nfa = nfa_main_new(new_start_state, new_accept_state);
-  return nfa;
+  return nfa_main_new(new_start_state, new_accept_state);
 }
 
-nfa_main_t *nfa_main_new_closure(nfa_main_t *nfa) {
-  nfa_state_t *new_start_state = nfa_state_new(false);
-  nfa_state_t *new_accept_state = nfa_state_new(true);
-
-  nfa_state_add_eps_transition(new_start_state, new_accept_state);
-  nfa_state_add_eps_transition(nfa->accept_state, nfa->start_state);
-  nfa_state_add_eps_transition(new_start_state, nfa->start_state);
-  nfa_state_add_eps_transition(nfa->accept_state, new_accept_state);
-
-  nfa_main_t *nfa = nfa_main_new(new_start_state, new_accept_state);
-  return nfa;
-}
+nfa_main_t nfa_main_new_closure(nfa_prog_t *prog, nfa_main_t nfa) {
+  int new_start_state = nfa_state_new(prog);
+  int new_accept_state = nfa_state_new(prog);
 
-nfa_main_t *nfa_main_new_concat(nfa_main_t *nfa_a, nfa_main_t *nfa_b) {
-  nfa_state_add_eps_transition(nfa_a->accept_state, nfa_b->start_state);
+  nfa_state_add_eps_transition(prog, new_start_state, nfa.start_state);
+  nfa_state_add_eps_transition(prog, new_start_state, new_accept_state);
+  nfa_state_add_eps_transition(prog, nfa.accept_state, nfa.start_state);
+  nfa_state_add_eps_transition(prog, nfa.accept_state, new_accept_state);
 
-  nfa_main_t *nfa = nfa_main_new(nfa_a->start_state, nfa_b->accept_state);
-  return nfa;
+  return nfa_main_new(new_start_state, new_accept_state);
 }
 
-nfa_main_t *nfa_main_list_append(nfa_main_t **list, nfa_main_t *nfa) {
-  if (list == NULL || *list == NULL) {
-    *list = nfa;
-    return *list;
-  }
+nfa_main_t nfa_main_new_group(nfa_prog_t *prog, nfa_main_t nfa, size_t group) {
+  int open_state = nfa_state_new(prog);
+  int close_state = nfa_state_new(prog);
 
-  nfa_main_t *head = *list;
+  prog->states[open_state].save_slot = 2 * group;
+  prog->states[close_state].save_slot = 2 * group + 1;
 
-  while (head->next != NULL)
-    head = head->next;
+  nfa_state_add_eps_transition(prog, open_state, nfa.start_state);
+  nfa_state_add_eps_transition(prog, nfa.accept_state, close_state);
 
-  nfa->prev = head;
-  head->next = nfa;
+  if (2 * group + 2 > prog->num_slots)
+    prog->num_slots = 2 * group + 2;
 
-  return head;
+  return nfa_main_new(open_state, close_state);
 }
 
-nfa_main_t *nfa_main_list_pop(nfa_main_t **list) {
-  if (list == NULL || *list == NULL) {
-    nfa_main_t *tail = *list;
-    *list = NULL;
-    return tail;
-  }
-
-  nfa_main_t *head = *list;
-
-  while (head->next != NULL)
-    head = head->next;
-
-  if (head->prev != NULL)
-    head->prev->next = NULL;
-
-  head->prev = NULL;
-
-  return head;
+nfa_main_t nfa_main_new_concat(nfa_prog_t *prog, nfa_main_t nfa_a,
+                               nfa_main_t nfa_b) {
+  nfa_state_add_eps_transition(prog, nfa_a.accept_state, nfa_b.start_state);
+  return nfa_main_new(nfa_a.start_state, nfa_b.accept_state);
 }
 
 str_buffer_t *add_concat_operator_to_regex(str_buffer_t *regex) {
   str_buffer_t *result =
       duplicate_memory(current_arena, regex, sizeof(str_buffer_t));
 
-  for (size_t i = 0; i < result->length - 1; i++) {
+  for (size_t i = 0; i + 1 < result->length; i++) {
     char32_t curr = result->contents[i];
     char32_t peek = result->contents[i + 1];
-    if (isalnum(curr) && isalnum(peek))
-      result = str_buffer_splice_char(result, i, ++i, U'\0');
-    else if ((isalnum(curr) || curr == U'*' || curr == U')') && peek == U'(')
-      result = str_buffer_splice_char(result, i, ++i, U'\0');
-    else if ((curr == U'*' || curr == U')') && isalnum(peek))
-      result = str_buffer_splice_char(result, i, ++i, U'\0');
-    else
-      continue;
+    bool ends_operand = isalnum(curr) || curr == U'*' || curr == U')';
+    bool starts_operand = isalnum(peek) || peek == U'(';
+
+    if (ends_operand && starts_operand) {
+      result = str_buffer_splice_char(result, i + 1, i + 2, U'\0');
+      i++;
+    }
   }
 
   return result;
@@ -353,30 +325,43 @@ str_buffer_t *add_concat_operator_to_regex(str_buffer_t *regex) {
 
 str_buffer_t *get_regex_to_postfix(const str_buffer_t *regex) {
   str_buffer_t *result = str_buffer_new_blank(regex->length);
-  char32_t const *operator_stack = calloc(1, regex->length);
+  char32_t *operator_stack = calloc(regex->length + 1, sizeof(char32_t));
   ssize_t stack_pointer = -1;
+  char32_t num_groups = 0;
+
+  if (operator_stack == NULL)
+    raise("Memory allocation error");
 
   for (size_t i = 0; i < regex->length; i++) {
     char32_t curr = regex->contents[i];
     if (isalnum(curr))
       result = str_buffer_add_char(result, curr);
     else if (curr == U'(')
-      operator_stack[++stack_pointer] = curr;
+      operator_stack[++stack_pointer] = REGEX_GROUP_BASE + ++num_groups;
     else if (curr == U')') {
-      while (stack_pointer != 0 && operator_stack[stack_pointer] != U'(')
+      while (stack_pointer >= 0 &&
+             !REGEX_IS_GROUP(operator_stack[stack_pointer]))
         result = str_buffer_add_char(result, operator_stack[stack_pointer--]);
 
-      if (stack_pointer != 0 && operator_stack[stack_pointer] == U'(')
-        stack_pointer--;
+      // The group marker becomes a unary postfix operator on the operand.
+      if (stack_pointer >= 0)
+        result = str_buffer_add_char(result, operator_stack[stack_pointer--]);
     } else if (curr == U'*' || curr == U'\0' || curr == U'|') {
-      while (stack_pointer != 0 &&
+      while (stack_pointer >= 0 &&
              get_regex_operator_precedence(operator_stack[stack_pointer]) >=
-                 get_regex_operator_precedence(cur))
+                 get_regex_operator_precedence(curr))
         result = str_buffer_add_char(result, operator_stack[stack_pointer--]);
       operator_stack[++stack_pointer] = curr;
     }
   }
 
+  while (stack_pointer >= 0) {
+    if (!REGEX_IS_GROUP(operator_stack[stack_pointer]))
+      result = str_buffer_add_char(result, operator_stack[stack_pointer]);
+    stack_pointer--;
+  }
+
+  free(operator_stack);
   return result;
 }
 
@@ -393,34 +378,1615 @@ int get_regex_operator_precedence(char32_t operator) {
   }
 }
 
-nfa_main_t *nfa_main_from_regexp(const str_buffer_t *regexp) {
-  nfa_main_t *nfa_stack = NULL;
+// Replays the operand stack depth of a postfix regex without building
+// anything, so a malformed pattern is rejected before memory is committed.
+static bool regex_postfix_is_valid(const str_buffer_t *postfix) {
+  size_t depth = 0;
+
+  for (size_t i = 0; i < postfix->length; i++) {
+    char32_t curr = postfix->contents[i];
+
+    if (curr == U'|' || curr == U'\0') {
+      if (depth < 2)
+        return false;
+      depth--;
+    } else if (curr == U'*' || REGEX_IS_GROUP(curr)) {
+      if (depth < 1)
+        return false;
+    } else
+      depth++;
+  }
+
+  return depth == 1;
+}
+
+nfa_prog_t *nfa_main_from_regexp(Arena *arena,
+                                 const str_buffer_t *regexp) {
+  // Literals, unions, closures and groups add two states each, concat adds
+  // none, and the whole expression is wrapped in group 0.
+  nfa_prog_t *prog = nfa_prog_new(arena, 2 * regexp->length + 2);
+  nfa_main_t *nfa_stack = malloc(regexp->length * sizeof(nfa_main_t));
+  size_t stack_pointer = 0;
+
+  if (regexp->length > 0 && nfa_stack == NULL)
+    raise("Memory allocation error");
+
+  for (size_t i = 0; i < regexp->length; i++) {
+    nfa_main_t nfa_a, nfa_b;
 
-  for (size_t i = 0; i < regexp->size; i++) {
     switch (regexp->contents[i]) {
     case U'|':
-      nfa_main_t *nfa_b = nfa_main_list_pop(&nfa_stack);
-      nfa_main_t *nfa_a = nfa_main_list_pop(&nfa_stack);
-      nfa_main_t union_nfa = nfa_main_new_union(nfa_a, nfa_b);
-      nfa_main_list_append(&nfa_stack, union_nfa);
+      if (stack_pointer < 2)
+        raise("Malformed regular expression");
+      nfa_b = nfa_stack[--stack_pointer];
+      nfa_a = nfa_stack[--stack_pointer];
+      nfa_stack[stack_pointer++] = nfa_main_new_union(prog, nfa_a, nfa_b);
+      continue;
+    case U'*':
+      if (stack_pointer < 1)
+        raise("Malformed regular expression");
+      nfa_a = nfa_stack[--stack_pointer];
+      nfa_stack[stack_pointer++] = nfa_main_new_closure(prog, nfa_a);
+      continue;
+    case U'\0':
+      if (stack_pointer < 2)
+        raise("Malformed regular expression");
+      nfa_b = nfa_stack[--stack_pointer];
+      nfa_a = nfa_stack[--stack_pointer];
+      nfa_stack[stack_pointer++] = nfa_main_new_concat(prog, nfa_a, nfa_b);
+      continue;
+    default:
+      if (REGEX_IS_GROUP(regexp->contents[i])) {
+        if (stack_pointer < 1)
+          raise("Malformed regular expression");
+        nfa_a = nfa_stack[--stack_pointer];
+        nfa_stack[stack_pointer++] = nfa_main_new_group(
+            prog, nfa_a, regexp->contents[i] - REGEX_GROUP_BASE);
+        continue;
+      }
+
+      nfa_stack[stack_pointer++] =
+          nfa_main_new_literal(prog, regexp->contents[i]);
+      continue;
+    }
+  }
+
+  if (stack_pointer != 1)
+    raise("Malformed regular expression");
+
+  nfa_main_t nfa = nfa_main_new_group(prog, nfa_stack[0], 0);
+  free(nfa_stack);
+
+  prog->start_state = nfa.start_state;
+  prog->accept_state = nfa.accept_state;
+  prog->states[prog->accept_state].is_accepting = true;
+  nfa_prog_compute_closures(prog);
+
+  return prog;
+}
+
+#define REGEX_LITERAL_MAX 64
+
+typedef struct RELiteral regex_literal_t;
+
+struct RELiteral {
+  str_buffer_t *exact;
+  str_buffer_t *prefix;
+  str_buffer_t *suffix;
+  str_buffer_t *required;
+};
+
+static str_buffer_t *regex_literal_slice(const str_buffer_t *string,
+                                         size_t start, size_t length) {
+  str_buffer_t *slice = str_buffer_new_blank(length);
+
+  for (size_t i = 0; i < length; i++)
+    slice = str_buffer_add_char(slice, string->contents[start + i]);
+
+  return slice;
+}
+
+static str_buffer_t *regex_literal_join(const str_buffer_t *head,
+                                        const str_buffer_t *tail,
+                                        bool keep_tail) {
+  str_buffer_t *joined = str_buffer_new_blank(head->length + tail->length);
+
+  for (size_t i = 0; i < head->length; i++)
+    joined = str_buffer_add_char(joined, head->contents[i]);
+  for (size_t i = 0; i < tail->length; i++)
+    joined = str_buffer_add_char(joined, tail->contents[i]);
+
+  if (joined->length <= REGEX_LITERAL_MAX)
+    return joined;
+
+  if (keep_tail)
+    return regex_literal_slice(joined, joined->length - REGEX_LITERAL_MAX,
+                               REGEX_LITERAL_MAX);
+  return regex_literal_slice(joined, 0, REGEX_LITERAL_MAX);
+}
+
+static str_buffer_t *regex_literal_common(const str_buffer_t *a,
+                                          const str_buffer_t *b,
+                                          bool from_tail) {
+  size_t length = 0;
+
+  while (length < a->length && length < b->length) {
+    size_t index_a = from_tail ? a->length - length - 1 : length;
+    size_t index_b = from_tail ? b->length - length - 1 : length;
+
+    if (a->contents[index_a] != b->contents[index_b])
+      break;
+    length++;
+  }
+
+  if (from_tail)
+    return regex_literal_slice(a, a->length - length, length);
+  return regex_literal_slice(a, 0, length);
+}
+
+static bool regex_literal_equals(const str_buffer_t *a, const str_buffer_t *b) {
+  return a->length == b->length &&
+         memcmp(a->contents, b->contents, a->length * sizeof(char32_t)) == 0;
+}
+
+static str_buffer_t *regex_literal_longest(str_buffer_t *a, str_buffer_t *b) {
+  return b->length > a->length ? b : a;
+}
+
+static regex_literal_t regex_literal_symbol(char32_t symbol) {
+  regex_literal_t literal;
+  literal.exact = str_buffer_add_char(str_buffer_new_blank(1), symbol);
+  literal.prefix = literal.exact;
+  literal.suffix = literal.exact;
+  literal.required = literal.exact;
+  return literal;
+}
+
+static regex_literal_t regex_literal_closure(void) {
+  regex_literal_t literal;
+  literal.exact = NULL;
+  literal.prefix = str_buffer_new_blank(0);
+  literal.suffix = literal.prefix;
+  literal.required = literal.prefix;
+  return literal;
+}
+
+static regex_literal_t regex_literal_concat(regex_literal_t a,
+                                            regex_literal_t b) {
+  regex_literal_t literal;
+  literal.exact = NULL;
+
+  if (a.exact != NULL && b.exact != NULL &&
+      a.exact->length + b.exact->length <= REGEX_LITERAL_MAX)
+    literal.exact = regex_literal_join(a.exact, b.exact, false);
+
+  literal.prefix =
+      a.exact != NULL ? regex_literal_join(a.exact, b.prefix, false) : a.prefix;
+  literal.suffix =
+      b.exact != NULL ? regex_literal_join(a.suffix, b.exact, true) : b.suffix;
+
+  // Every match of AB contains A's suffix immediately followed by B's prefix.
+  literal.required = regex_literal_longest(
+      regex_literal_longest(a.required, b.required),
+      regex_literal_join(a.suffix, b.prefix, false));
+  return literal;
+}
+
+static regex_literal_t regex_literal_union(regex_literal_t a,
+                                           regex_literal_t b) {
+  regex_literal_t literal;
+  literal.exact = NULL;
+
+  if (a.exact != NULL && b.exact != NULL &&
+      regex_literal_equals(a.exact, b.exact))
+    literal.exact = a.exact;
+
+  literal.prefix = regex_literal_common(a.prefix, b.prefix, false);
+  literal.suffix = regex_literal_common(a.suffix, b.suffix, true);
+  literal.required = regex_literal_longest(literal.prefix, literal.suffix);
+
+  if (regex_literal_equals(a.required, b.required))
+    literal.required = regex_literal_longest(literal.required, a.required);
+
+  return literal;
+}
+
+regex_literal_t regex_literal_from_postfix(const str_buffer_t *postfix) {
+  regex_literal_t *literal_stack =
+      request_memory(current_arena, postfix->length * sizeof(regex_literal_t));
+  size_t stack_pointer = 0;
+
+  if (literal_stack == NULL)
+    raise("Region allocation error");
+
+  for (size_t i = 0; i < postfix->length; i++) {
+    regex_literal_t literal_a, literal_b;
+
+    switch (postfix->contents[i]) {
+    case U'|':
+      literal_b = literal_stack[--stack_pointer];
+      literal_a = literal_stack[--stack_pointer];
+      literal_stack[stack_pointer++] =
+          regex_literal_union(literal_a, literal_b);
       continue;
     case U'*':
-      nfa_main_t *nfa = nfa_main_list_pop(&nfa_stack);
-      nfa_main_t *closure_nfa = nfa_main_new_closure(nfa);
-      nfa_main_list_append(&nfa_stack, closure_nfa);
+      literal_stack[stack_pointer - 1] = regex_literal_closure();
       continue;
     case U'\0':
-      nfa_main_t *nfa_b = nfa_main_list_pop(&nfa_stack);
-      nfa_main_t *nfa_a = nfa_main_list_pop(&nfa_stack);
-      nfa_main_t concat_nfa = nfa_main_new_concat(nfa_a, nfa_b);
-      nfa_main_list_append(&nfa_stack, concat_nfa);
+      literal_b = literal_stack[--stack_pointer];
+      literal_a = literal_stack[--stack_pointer];
+      literal_stack[stack_pointer++] =
+          regex_literal_concat(literal_a, literal_b);
       continue;
     default:
-      nfa_main_t *literal_nfa = nfa_main_new_literal(regexp->contents[i]);
-      nfa_main_list_append(&nfa_stack, literal_nfa);
+      if (REGEX_IS_GROUP(postfix->contents[i]))
+        continue;
+
+      literal_stack[stack_pointer++] =
+          regex_literal_symbol(postfix->contents[i]);
       continue;
     }
   }
 
-  return nfa_main_list_pop(&nfa_stack);
+  return literal_stack[0];
+}
+
+#define DFA_CACHE_MAX_STATES 2048
+#define DFA_CACHE_BUCKETS 4096
+#define DFA_BYTE_RANGE 256
+
+typedef struct DFAState dfa_state_t;
+typedef struct DFACache dfa_cache_t;
+
+struct DFAState {
+  int *nfa_states;
+  size_t num_states;
+  uint64_t hash;
+  bool is_accepting;
+  dfa_state_t **trans;
+  struct DFAState *bucket_next;
+};
+
+struct DFACache {
+  const nfa_prog_t *prog;
+  Arena *arena;
+  Arena *states;
+  dfa_state_t *start_state;
+  dfa_state_t *buckets[DFA_CACHE_BUCKETS];
+  size_t num_states;
+  size_t max_states;
+  uint32_t byte_classes[DFA_BYTE_RANGE];
+  char32_t *wide_symbols;
+  size_t num_wide;
+  size_t num_classes;
+  nfa_state_set_t *set;
+  int *current;
+  int *scratch;
+};
+
+static size_t dfa_cache_step(dfa_cache_t *cache, const int *from,
+                             size_t num_from, char32_t chr) {
+  nfa_state_set_clear(cache->set);
+
+  for (size_t i = 0; i < num_from; i++) {
+    const nfa_trans_t *trans = &cache->prog->states[from[i]].trans;
+
+    if (trans->target != NO_STATE && trans->symbol == chr)
+      nfa_state_set_add_closure(cache->prog, cache->set, trans->target);
+  }
+
+  return cache->set->length;
+}
+
+static int dfa_nfa_state_compare(const void *a, const void *b) {
+  int id_a = *(const int *)a;
+  int id_b = *(const int *)b;
+  return (id_a > id_b) - (id_a < id_b);
+}
+
+static int dfa_symbol_compare(const void *a, const void *b) {
+  char32_t chr_a = *(const char32_t *)a;
+  char32_t chr_b = *(const char32_t *)b;
+  return (chr_a > chr_b) - (chr_a < chr_b);
+}
+
+static dfa_state_t *dfa_cache_intern(dfa_cache_t *cache) {
+  size_t count = cache->set->length;
+
+  memcpy(cache->scratch, cache->set->dense, count * sizeof(int));
+  qsort(cache->scratch, count, sizeof(int), dfa_nfa_state_compare);
+
+  uint64_t hash = 14695981039346656037ULL;
+  for (size_t i = 0; i < count; i++) {
+    hash ^= (uint64_t)cache->scratch[i];
+    hash *= 1099511628211ULL;
+  }
+
+  size_t bucket = hash % DFA_CACHE_BUCKETS;
+  dfa_state_t *state = cache->buckets[bucket];
+
+  while (state != NULL) {
+    if (state->hash == hash && state->num_states == count &&
+        memcmp(state->nfa_states, cache->scratch, count * sizeof(int)) == 0)
+      return state;
+    state = state->bucket_next;
+  }
+
+  if (cache->num_states >= cache->max_states)
+    return NULL;
+
+  // Searches may run on worker threads, which must not raise, so a state
+  // that cannot be allocated is reported just like a full cache.
+  state = request_memory(cache->states, sizeof(dfa_state_t));
+
+  if (state == NULL)
+    return NULL;
+
+  state->nfa_states = request_memory(cache->states, count * sizeof(int));
+  state->trans = request_memory(cache->states, 2 * cache->num_classes *
+                                                   sizeof(dfa_state_t *));
+
+  if (state->nfa_states == NULL || state->trans == NULL)
+    return NULL;
+
+  memcpy(state->nfa_states, cache->scratch, count * sizeof(int));
+  state->num_states = count;
+  state->hash = hash;
+  state->is_accepting =
+      nfa_state_set_contains(cache->set, cache->prog->accept_state);
+  memset(state->trans, 0, 2 * cache->num_classes * sizeof(dfa_state_t *));
+
+  state->bucket_next = cache->buckets[bucket];
+  cache->buckets[bucket] = state;
+  cache->num_states++;
+
+  return state;
+}
+
+// Code points the program never tests all behave alike and share class 0;
+// every symbol it does test gets a class of its own. Latin-1 is looked up
+// directly and wider symbols by binary search, so the transition tables stay
+// as small as the pattern whatever script the text is in.
+static void dfa_cache_classify(dfa_cache_t *cache) {
+  const nfa_prog_t *prog = cache->prog;
+  size_t num_byte_classes = 0;
+
+  memset(cache->byte_classes, 0, sizeof(cache->byte_classes));
+  cache->wide_symbols =
+      regex_request(cache->arena, (prog->num_states + 1) * sizeof(char32_t));
+  cache->num_wide = 0;
+
+  for (size_t i = 0; i < prog->num_states; i++) {
+    const nfa_trans_t *trans = &prog->states[i].trans;
+
+    if (trans->target == NO_STATE)
+      continue;
+
+    if (trans->symbol >= DFA_BYTE_RANGE)
+      cache->wide_symbols[cache->num_wide++] = trans->symbol;
+    else if (cache->byte_classes[trans->symbol] == 0)
+      cache->byte_classes[trans->symbol] = ++num_byte_classes;
+  }
+
+  qsort(cache->wide_symbols, cache->num_wide, sizeof(char32_t),
+        dfa_symbol_compare);
+
+  size_t unique = 0;
+
+  for (size_t i = 0; i < cache->num_wide; i++)
+    if (unique == 0 ||
+        cache->wide_symbols[unique - 1] != cache->wide_symbols[i])
+      cache->wide_symbols[unique++] = cache->wide_symbols[i];
+
+  cache->num_wide = unique;
+  cache->num_classes = 1 + num_byte_classes + unique;
+}
+
+static size_t dfa_cache_class(const dfa_cache_t *cache, char32_t chr) {
+  if (chr < DFA_BYTE_RANGE)
+    return cache->byte_classes[chr];
+
+  size_t low = 0, high = cache->num_wide;
+
+  while (low < high) {
+    size_t mid = low + (high - low) / 2;
+
+    if (cache->wide_symbols[mid] < chr)
+      low = mid + 1;
+    else
+      high = mid;
+  }
+
+  if (low < cache->num_wide && cache->wide_symbols[low] == chr)
+    return cache->num_classes - cache->num_wide + low;
+  return 0;
+}
+
+static void dfa_cache_seed(dfa_cache_t *cache) {
+  memset(cache->buckets, 0, sizeof(cache->buckets));
+  cache->num_states = 0;
+
+  nfa_state_set_clear(cache->set);
+  nfa_state_set_add_closure(cache->prog, cache->set, cache->prog->start_state);
+  cache->start_state = dfa_cache_intern(cache);
+}
+
+// States live in an arena of their own, so a full cache can be dropped
+// wholesale and rebuilt for the text that is being searched now.
+dfa_cache_t *dfa_cache_new(const nfa_prog_t *prog, Arena *arena,
+                           size_t max_states) {
+  dfa_cache_t *cache = regex_request(arena, sizeof(dfa_cache_t));
+
+  cache->prog = prog;
+  cache->arena = arena;
+  cache->states = arena_new();
+
+  if (cache->states == NULL)
+    raise("Memory allocation error");
+
+  cache->max_states = max_states == 0 ? DFA_CACHE_MAX_STATES : max_states;
+  cache->set = nfa_state_set_new(arena, prog->num_states);
+  cache->current = regex_request(arena, prog->num_states * sizeof(int));
+  cache->scratch = regex_request(arena, prog->num_states * sizeof(int));
+  dfa_cache_classify(cache);
+  dfa_cache_seed(cache);
+
+  if (cache->start_state == NULL)
+    raise("Memory allocation error");
+
+  return cache;
+}
+
+void dfa_cache_flush(dfa_cache_t *cache) {
+  arena_reset(cache->states);
+  dfa_cache_seed(cache);
+}
+
+size_t dfa_cache_bytes(const dfa_cache_t *cache) {
+  return arena_bytes(cache->states);
+}
+
+void dfa_cache_free(dfa_cache_t *cache) { arena_destroy(cache->states); }
+
+// Each state keeps two rows of transitions: anchored ones, and unanchored
+// ones that also re-seed the start state as if the pattern began with .*.
+// Returns NULL once the cache is full and the step is not already known.
+static dfa_state_t *dfa_cache_next(dfa_cache_t *cache, dfa_state_t *state,
+                                   char32_t chr, bool anchored) {
+  size_t slot =
+      dfa_cache_class(cache, chr) + (anchored ? 0 : cache->num_classes);
+  dfa_state_t *next = state->trans[slot];
+
+  if (next != NULL)
+    return next;
+
+  dfa_cache_step(cache, state->nfa_states, state->num_states, chr);
+
+  if (!anchored)
+    nfa_state_set_add_closure(cache->prog, cache->set,
+                              cache->prog->start_state);
+
+  next = dfa_cache_intern(cache);
+
+  if (next != NULL)
+    state->trans[slot] = next;
+
+  return next;
+}
+
+static bool dfa_cache_fallback_match(dfa_cache_t *cache, const char32_t *input,
+                                     size_t input_length) {
+  size_t count = cache->set->length;
+
+  for (size_t i = 0; i < input_length; i++) {
+    if (count == 0)
+      return false;
+
+    memcpy(cache->current, cache->set->dense, count * sizeof(int));
+    count = dfa_cache_step(cache, cache->current, count, input[i]);
+  }
+
+  return nfa_state_set_contains(cache->set, cache->prog->accept_state);
+}
+
+bool dfa_simulate_and_match(dfa_cache_t *cache, const char32_t *input,
+                            size_t input_length) {
+  dfa_state_t *state = cache->start_state;
+
+  // A flush that could not intern the start state leaves none behind.
+  if (state == NULL) {
+    nfa_state_set_clear(cache->set);
+    nfa_state_set_add_closure(cache->prog, cache->set,
+                              cache->prog->start_state);
+    return dfa_cache_fallback_match(cache, input, input_length);
+  }
+
+  for (size_t i = 0; i < input_length; i++) {
+    if (state->num_states == 0)
+      return false;
+
+    dfa_state_t *next = dfa_cache_next(cache, state, input[i], true);
+
+    // Cache is full: keep stepping NFA state sets without interning them.
+    if (next == NULL)
+      return dfa_cache_fallback_match(cache, &input[i + 1],
+                                      input_length - i - 1);
+
+    state = next;
+  }
+
+  return state->is_accepting;
+}
+
+#define REGEX_NO_MATCH ((size_t)-1)
+#define REGEX_CACHE_BUDGET (8 * 1024 * 1024)
+#define REGEX_CACHE_BUCKETS 64
+#define REGEX_PROBE_FACTOR 4
+#define REGEX_PROBE_SLACK 64
+
+typedef struct RECompiled regex_compiled_t;
+typedef struct RECache regex_cache_t;
+typedef struct REText regex_text_t;
+typedef struct REScratch regex_scratch_t;
+typedef struct REMatch regex_match_t;
+typedef struct REMatchIter regex_match_iter_t;
+typedef struct REPikeFrame regex_pike_frame_t;
+
+struct REPikeFrame {
+  int state;
+  const size_t *caps;
+};
+
+struct RECompiled {
+  Arena *arena;
+  char32_t *pattern;
+  size_t pattern_length;
+  uint64_t hash;
+  nfa_prog_t *prog;
+  char32_t *prefix;
+  size_t prefix_length;
+  char32_t *required;
+  size_t required_length;
+  size_t *seed_caps;
+  regex_scratch_t *scratch;
+  size_t pins;
+  struct RECompiled *bucket_next;
+  struct RECompiled *lru_next;
+  struct RECompiled *lru_prev;
+};
+
+struct REScratch {
+  dfa_cache_t *dfa;
+  nfa_state_set_t *threads[2];
+  size_t *thread_starts[2];
+  size_t *thread_caps[2];
+  size_t *match_caps;
+  regex_pike_frame_t *pike_stack;
+};
+
+struct REText {
+  const void *segments[2];
+  size_t lengths[2];
+  unsigned char widths[2];
+  size_t length;
+};
+
+struct RECache {
+  regex_compiled_t *buckets[REGEX_CACHE_BUCKETS];
+  regex_compiled_t *lru_head;
+  regex_compiled_t *lru_tail;
+  size_t budget;
+};
+
+static regex_cache_t regex_cache = {.budget = REGEX_CACHE_BUDGET};
+static Arena *regex_compile_arena;
+
+struct REMatch {
+  size_t start;
+  size_t end;
+};
+
+struct REMatchIter {
+  regex_compiled_t *re;
+  txt_buffer_t *buffer;
+  txt_iter_t lines;
+  str_buffer_t *line;
+  size_t line_no;
+  size_t end_line;
+  size_t offset;
+  size_t last_end;
+  bool global;
+  size_t match_line;
+  regex_match_t match;
+};
+
+size_t u32_find_char(const char32_t *text, size_t length, char32_t chr) {
+  size_t i = 0;
+
+#if defined(__AVX2__)
+  __m256i needle = _mm256_set1_epi32((int)chr);
+
+  for (; i + 8 <= length; i += 8) {
+    __m256i block = _mm256_loadu_si256((const __m256i *)&text[i]);
+    unsigned mask = _mm256_movemask_ps(
+        _mm256_castsi256_ps(_mm256_cmpeq_epi32(block, needle)));
+
+    if (mask != 0)
+      return i + __builtin_ctz(mask);
+  }
+#elif defined(__SSE2__)
+  __m128i needle = _mm_set1_epi32((int)chr);
+
+  for (; i + 4 <= length; i += 4) {
+    __m128i block = _mm_loadu_si128((const __m128i *)&text[i]);
+    unsigned mask =
+        _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(block, needle)));
+
+    if (mask != 0)
+      return i + __builtin_ctz(mask);
+  }
+#endif
+
+  for (; i < length; i++) {
+    if (text[i] == chr)
+      return i;
+  }
+
+  return length;
+}
+
+size_t u32_find_literal(const char32_t *text, size_t length,
+                        const char32_t *literal, size_t literal_length) {
+  if (literal_length == 0)
+    return 0;
+
+  size_t pos = 0;
+
+  while (pos + literal_length <= length) {
+    pos += u32_find_char(&text[pos], length - literal_length + 1 - pos,
+                         literal[0]);
+
+    if (pos + literal_length > length)
+      break;
+
+    if (memcmp(&text[pos + 1], &literal[1],
+               (literal_length - 1) * sizeof(char32_t)) == 0)
+      return pos;
+    pos++;
+  }
+
+  return length;
+}
+
+static inline char32_t regex_segment_at(const void *segment, unsigned width,
+                                        size_t pos) {
+  switch (width) {
+  case sizeof(uint8_t):
+    return ((const uint8_t *)segment)[pos];
+  case sizeof(uint16_t):
+    return ((const uint16_t *)segment)[pos];
+  default:
+    return ((const char32_t *)segment)[pos];
+  }
+}
+
+static inline const void *regex_segment_offset(const void *segment,
+                                               unsigned width, size_t pos) {
+  return (const uint8_t *)segment + pos * width;
+}
+
+static size_t regex_segment_find_literal(const void *segment, unsigned width,
+                                         size_t length,
+                                         const char32_t *literal,
+                                         size_t literal_length) {
+  if (width == sizeof(char32_t))
+    return u32_find_literal(segment, length, literal, literal_length);
+
+  if (literal_length == 0)
+    return 0;
+
+  // A literal with a code point wider than the segment cannot occur in it.
+  char32_t max = width == sizeof(uint8_t) ? 0xFF : 0xFFFF;
+
+  for (size_t i = 0; i < literal_length; i++)
+    if (literal[i] > max)
+      return length;
+
+  size_t pos = 0;
+
+  while (pos + literal_length <= length) {
+    if (width == sizeof(uint8_t)) {
+      const uint8_t *bytes = segment;
+      const uint8_t *hit = memchr(&bytes[pos], (int)literal[0],
+                                  length - literal_length + 1 - pos);
+
+      if (hit == NULL)
+        break;
+      pos = hit - bytes;
+    } else {
+      while (pos + literal_length <= length &&
+             regex_segment_at(segment, width, pos) != literal[0])
+        pos++;
+
+      if (pos + literal_length > length)
+        break;
+    }
+
+    size_t i = 1;
+
+    while (i < literal_length &&
+           regex_segment_at(segment, width, pos + i) == literal[i])
+      i++;
+
+    if (i == literal_length)
+      return pos;
+    pos++;
+  }
+
+  return length;
+}
+
+regex_text_t regex_text_compact(const void *head, size_t head_length,
+                                unsigned head_width, const void *tail,
+                                size_t tail_length, unsigned tail_width) {
+  regex_text_t text;
+  text.segments[0] = head;
+  text.lengths[0] = head_length;
+  text.widths[0] = head_width;
+  text.segments[1] = tail;
+  text.lengths[1] = tail_length;
+  text.widths[1] = tail_width;
+  text.length = head_length + tail_length;
+  return text;
+}
+
+regex_text_t regex_text_segments(const char32_t *head, size_t head_length,
+                                 const char32_t *tail, size_t tail_length) {
+  return regex_text_compact(head, head_length, sizeof(char32_t), tail,
+                            tail_length, sizeof(char32_t));
+}
+
+static inline char32_t regex_text_at(const regex_text_t *text, size_t pos) {
+  if (pos < text->lengths[0])
+    return regex_segment_at(text->segments[0], text->widths[0], pos);
+  return regex_segment_at(text->segments[1], text->widths[1],
+                          pos - text->lengths[0]);
+}
+
+size_t regex_text_find_literal(const regex_text_t *text, size_t from,
+                               const char32_t *literal,
+                               size_t literal_length) {
+  size_t head_length = text->lengths[0];
+
+  if (from < head_length) {
+    size_t pos = regex_segment_find_literal(
+        regex_segment_offset(text->segments[0], text->widths[0], from),
+        text->widths[0], head_length - from, literal, literal_length);
+
+    if (pos < head_length - from)
+      return from + pos;
+  }
+
+  // Occurrences straddling the seam are checked one start at a time; there
+  // are at most literal_length - 1 of them.
+  size_t seam = head_length >= literal_length ? head_length - literal_length + 1
+                                              : 0;
+
+  for (size_t start = seam > from ? seam : from;
+       start < head_length && start + literal_length <= text->length;
+       start++) {
+    size_t i = 0;
+
+    while (i < literal_length && regex_text_at(text, start + i) == literal[i])
+      i++;
+
+    if (i == literal_length)
+      return start;
+  }
+
+  size_t tail_from = from > head_length ? from - head_length : 0;
+
+  if (tail_from < text->lengths[1]) {
+    size_t pos = regex_segment_find_literal(
+        regex_segment_offset(text->segments[1], text->widths[1], tail_from),
+        text->widths[1], text->lengths[1] - tail_from, literal,
+        literal_length);
+
+    if (pos < text->lengths[1] - tail_from)
+      return head_length + tail_from + pos;
+  }
+
+  return text->length;
+}
+
+regex_scratch_t *regex_scratch_new(const regex_compiled_t *re,
+                                   Arena *arena) {
+  regex_scratch_t *scratch = regex_request(arena, sizeof(regex_scratch_t));
+  size_t num_states = re->prog->num_states;
+  size_t num_slots = re->prog->num_slots;
+
+  // Each scratch builds its own DFA, so workers searching with the same
+  // regex never write to a shared cache.
+  scratch->dfa = dfa_cache_new(re->prog, arena, DFA_CACHE_MAX_STATES);
+
+  for (int i = 0; i < 2; i++) {
+    scratch->threads[i] = nfa_state_set_new(arena, num_states);
+    scratch->thread_starts[i] =
+        regex_request(arena, num_states * sizeof(size_t));
+    scratch->thread_caps[i] =
+        regex_request(arena, num_states * num_slots * sizeof(size_t));
+  }
+
+  scratch->match_caps = regex_request(arena, num_slots * sizeof(size_t));
+  scratch->pike_stack = regex_request(
+      arena, (2 * num_states + 1) * sizeof(regex_pike_frame_t));
+
+  return scratch;
+}
+
+void regex_scratch_free(regex_scratch_t *scratch) {
+  dfa_cache_free(scratch->dfa);
+}
+
+// Postfix strings and literal sets are only needed while compiling. They are
+// built in a shared scratch arena, made current for the helpers that
+// allocate from current_arena, and the arena is reset once the regex is done.
+static Arena *regex_compile_scratch(void) {
+  if (regex_compile_arena == NULL)
+    regex_compile_arena = arena_new();
+
+  if (regex_compile_arena == NULL)
+    raise("Region allocation error");
+
+  return regex_compile_arena;
+}
+
+regex_compiled_t *regex_compile(str_buffer_t *pattern) {
+  Arena *active = current_arena;
+
+  current_arena = regex_compile_scratch();
+
+  // The pattern is kept before the concat pass rewrites it in place.
+  char32_t *source =
+      regex_duplicate(regex_compile_arena, pattern->contents,
+                      pattern->length * sizeof(char32_t));
+  size_t source_length = pattern->length;
+  str_buffer_t *postfix =
+      get_regex_to_postfix(add_concat_operator_to_regex(pattern));
+
+  // Nothing is owned yet, so a malformed pattern only has to give back the
+  // scratch arena and the caller's current_arena.
+  if (!regex_postfix_is_valid(postfix)) {
+    arena_reset(regex_compile_arena);
+    current_arena = active;
+    raise("Malformed regular expression");
+  }
+
+  current_arena = active;
+
+  Arena *arena = arena_new();
+
+  if (arena == NULL) {
+    arena_reset(regex_compile_arena);
+    raise("Region allocation error");
+  }
+
+  regex_compiled_t *re = regex_request(arena, sizeof(regex_compiled_t));
+
+  // The regex lives inside its own arena, so destroying the arena frees the
+  // compiled program, its DFA cache and its match scratch in one go.
+  re->arena = arena;
+  re->pattern = regex_duplicate(re->arena, source,
+                                source_length * sizeof(char32_t));
+  re->pattern_length = source_length;
+  re->hash = 0;
+  re->pins = 0;
+  re->bucket_next = NULL;
+  re->lru_next = NULL;
+  re->lru_prev = NULL;
+  re->prog = nfa_main_from_regexp(re->arena, postfix);
+  current_arena = regex_compile_arena;
+
+  regex_literal_t literal = regex_literal_from_postfix(postfix);
+
+  current_arena = active;
+  re->prefix =
+      regex_duplicate(re->arena, literal.prefix->contents,
+                      literal.prefix->length * sizeof(char32_t));
+  re->prefix_length = literal.prefix->length;
+  re->required =
+      regex_duplicate(re->arena, literal.required->contents,
+                      literal.required->length * sizeof(char32_t));
+  re->required_length = literal.required->length;
+  arena_reset(regex_compile_arena);
+
+  re->seed_caps =
+      regex_request(re->arena, re->prog->num_slots * sizeof(size_t));
+
+  for (size_t i = 0; i < re->prog->num_slots; i++)
+    re->seed_caps[i] = REGEX_NO_MATCH;
+
+  re->scratch = regex_scratch_new(re, re->arena);
+  return re;
+}
+
+void regex_free(regex_compiled_t *re) {
+  regex_scratch_free(re->scratch);
+  arena_destroy(re->arena);
+}
+
+static uint64_t regex_cache_hash(const char32_t *pattern, size_t length) {
+  uint64_t hash = 14695981039346656037ULL;
+
+  for (size_t i = 0; i < length; i++) {
+    hash ^= (uint64_t)pattern[i];
+    hash *= 1099511628211ULL;
+  }
+
+  return hash;
+}
+
+static void regex_cache_unlink(regex_compiled_t *re) {
+  if (re->lru_prev != NULL)
+    re->lru_prev->lru_next = re->lru_next;
+  else
+    regex_cache.lru_head = re->lru_next;
+
+  if (re->lru_next != NULL)
+    re->lru_next->lru_prev = re->lru_prev;
+  else
+    regex_cache.lru_tail = re->lru_prev;
+
+  re->lru_next = NULL;
+  re->lru_prev = NULL;
+}
+
+static void regex_cache_push_front(regex_compiled_t *re) {
+  re->lru_next = regex_cache.lru_head;
+  re->lru_prev = NULL;
+
+  if (regex_cache.lru_head != NULL)
+    regex_cache.lru_head->lru_prev = re;
+  else
+    regex_cache.lru_tail = re;
+
+  regex_cache.lru_head = re;
+}
+
+static void regex_cache_evict(regex_compiled_t *re) {
+  regex_compiled_t **link =
+      &regex_cache.buckets[re->hash % REGEX_CACHE_BUCKETS];
+
+  while (*link != re)
+    link = &(*link)->bucket_next;
+
+  *link = re->bucket_next;
+  regex_cache_unlink(re);
+  regex_free(re);
+}
+
+size_t regex_cache_bytes(void) {
+  size_t bytes = 0;
+
+  // DFA states keep being added after compilation, so the total is summed on
+  // demand rather than tracked at insertion time.
+  for (regex_compiled_t *re = regex_cache.lru_head; re != NULL;
+       re = re->lru_next)
+    bytes += arena_bytes(re->arena) + dfa_cache_bytes(re->scratch->dfa);
+
+  return bytes;
+}
+
+void regex_cache_set_budget(size_t budget) { regex_cache.budget = budget; }
+
+// Least recently used entries go first. Pinned ones are skipped, so the
+// cache may sit over budget until they are released.
+static void regex_cache_trim(void) {
+  size_t bytes = regex_cache_bytes();
+  regex_compiled_t *re = regex_cache.lru_tail;
+
+  while (bytes > regex_cache.budget && re != NULL) {
+    regex_compiled_t *prev = re->lru_prev;
+
+    if (re->pins == 0) {
+      bytes -= arena_bytes(re->arena) + dfa_cache_bytes(re->scratch->dfa);
+      regex_cache_evict(re);
+    }
+
+    re = prev;
+  }
+}
+
+// The regex returned is pinned and stays valid across further lookups
+// until the caller hands it back with regex_cache_release.
+regex_compiled_t *regex_cache_lookup(str_buffer_t *pattern) {
+  uint64_t hash = regex_cache_hash(pattern->contents, pattern->length);
+  size_t bucket = hash % REGEX_CACHE_BUCKETS;
+  regex_compiled_t *re = regex_cache.buckets[bucket];
+
+  while (re != NULL) {
+    if (re->hash == hash && re->pattern_length == pattern->length &&
+        memcmp(re->pattern, pattern->contents,
+               pattern->length * sizeof(char32_t)) == 0)
+      break;
+    re = re->bucket_next;
+  }
+
+  if (re != NULL) {
+    regex_cache_unlink(re);
+  } else {
+    re = regex_compile(pattern);
+    re->hash = hash;
+    re->bucket_next = regex_cache.buckets[bucket];
+    regex_cache.buckets[bucket] = re;
+  }
+
+  regex_cache_push_front(re);
+  re->pins++;
+  regex_cache_trim();
+  return re;
+}
+
+void regex_cache_release(regex_compiled_t *re) {
+  re->pins--;
+  regex_cache_trim();
+}
+
+size_t regex_prefilter_next(const regex_compiled_t *re,
+                            const regex_text_t *text, size_t from,
+                            size_t *limit) {
+  if (from > text->length)
+    return REGEX_NO_MATCH;
+
+  if (re->prefix_length > 0) {
+    size_t pos =
+        regex_text_find_literal(text, from, re->prefix, re->prefix_length);
+
+    if (pos == text->length)
+      return REGEX_NO_MATCH;
+
+    *limit = pos;
+    return pos;
+  }
+
+  // Without a prefix, any start up to the next occurrence of the required
+  // literal is a candidate; later starts must look for another occurrence.
+  if (re->required_length > 0) {
+    size_t pos =
+        regex_text_find_literal(text, from, re->required, re->required_length);
+
+    if (pos == text->length)
+      return REGEX_NO_MATCH;
+
+    *limit = pos;
+    return from;
+  }
+
+  *limit = text->length;
+  return from;
+}
+
+bool regex_match(regex_compiled_t *re, const char32_t *input,
+                 size_t input_length) {
+  if (re->prefix_length > 0 &&
+      (input_length < re->prefix_length ||
+       memcmp(input, re->prefix, re->prefix_length * sizeof(char32_t)) != 0))
+    return false;
+
+  if (re->required_length > 0 &&
+      u32_find_literal(input, input_length, re->required,
+                       re->required_length) == input_length)
+    return false;
+
+  return dfa_simulate_and_match(re->scratch->dfa, input, input_length);
+}
+
+static void regex_add_thread(const nfa_prog_t *prog, nfa_state_set_t *set,
+                             size_t *starts, int state, size_t start) {
+  const nfa_state_t *from = &prog->states[state];
+
+  for (size_t i = 0; i < from->closure_length; i++) {
+    if (nfa_state_set_insert(set, from->closure[i]))
+      starts[from->closure[i]] = start;
+  }
+}
+
+static bool regex_search_threads(const regex_compiled_t *re,
+                                 regex_scratch_t *scratch,
+                                 const regex_text_t *text, size_t from,
+                                 regex_match_t *match) {
+  const nfa_prog_t *prog = re->prog;
+  nfa_state_set_t *current = scratch->threads[0];
+  nfa_state_set_t *next = scratch->threads[1];
+  size_t *current_starts = scratch->thread_starts[0];
+  size_t *next_starts = scratch->thread_starts[1];
+  size_t best_start = REGEX_NO_MATCH;
+  size_t best_end = 0;
+  size_t limit = 0;
+  size_t pos = regex_prefilter_next(re, text, from, &limit);
+
+  if (pos == REGEX_NO_MATCH)
+    return false;
+
+  size_t candidate = pos;
+
+  nfa_state_set_clear(current);
+  regex_add_thread(prog, current, current_starts, prog->start_state, pos);
+
+  // Threads are kept ordered by start position, so when two reach the same
+  // state the earlier start wins and the leftmost match is preserved.
+  for (;;) {
+    if (nfa_state_set_contains(current, prog->accept_state)) {
+      size_t start = current_starts[prog->accept_state];
+
+      if (best_start == REGEX_NO_MATCH || start < best_start ||
+          (start == best_start && pos > best_end)) {
+        best_start = start;
+        best_end = pos;
+      }
+    }
+
+    if (pos == text->length)
+      break;
+
+    char32_t chr = regex_text_at(text, pos);
+    nfa_state_set_clear(next);
+
+    for (size_t i = 0; i < current->length; i++) {
+      int id = current->dense[i];
+      const nfa_trans_t *trans = &prog->states[id].trans;
+
+      if (best_start != REGEX_NO_MATCH && current_starts[id] > best_start)
+        continue;
+
+      if (trans->target != NO_STATE && trans->symbol == chr)
+        regex_add_thread(prog, next, next_starts, trans->target,
+                         current_starts[id]);
+    }
+
+    pos++;
+
+    // The implicit leading .* only seeds new threads until a match is
+    // found, and only at positions the literal prefilter allows.
+    if (best_start == REGEX_NO_MATCH) {
+      if (candidate != REGEX_NO_MATCH && pos > limit)
+        candidate = regex_prefilter_next(re, text, pos, &limit);
+      else if (candidate != REGEX_NO_MATCH && pos > candidate)
+        candidate = pos;
+
+      if (candidate != REGEX_NO_MATCH && nfa_state_set_empty(next))
+        pos = candidate;
+
+      if (candidate == pos)
+        regex_add_thread(prog, next, next_starts, prog->start_state, pos);
+    }
+
+    if (nfa_state_set_empty(next))
+      break;
+
+    nfa_state_set_t *swap_set = current;
+    current = next;
+    next = swap_set;
+
+    size_t *swap_starts = current_starts;
+    current_starts = next_starts;
+    next_starts = swap_starts;
+  }
+
+  if (best_start == REGEX_NO_MATCH)
+    return false;
+
+  match->start = best_start;
+  match->end = best_end;
+  return true;
+}
+
+enum DFAResult {
+  DFA_NoMatch,
+  DFA_Match,
+  DFA_GaveUp,
+};
+
+// Runs the unanchored DFA from a candidate start and stops at the first
+// position where any match ends. While only the start state is live, the
+// literal prefilter skips ahead to the next place a match could begin.
+static enum DFAResult regex_dfa_first_end(const regex_compiled_t *re,
+                                          dfa_cache_t *cache,
+                                          const regex_text_t *text,
+                                          size_t pos, size_t *end) {
+  dfa_state_t *state = cache->start_state;
+  size_t limit = pos;
+
+  for (;;) {
+    if (state->is_accepting) {
+      *end = pos;
+      return DFA_Match;
+    }
+
+    if (pos == text->length)
+      return DFA_NoMatch;
+
+    if (state == cache->start_state && pos > limit) {
+      pos = regex_prefilter_next(re, text, pos, &limit);
+
+      if (pos == REGEX_NO_MATCH)
+        return DFA_NoMatch;
+      continue;
+    }
+
+    state = dfa_cache_next(cache, state, regex_text_at(text, pos++), false);
+
+    if (state == NULL)
+      return DFA_GaveUp;
+  }
+}
+
+// Runs the anchored DFA from start until it dies and reports the last
+// position where it accepted, which is the end of the longest match there.
+static enum DFAResult regex_dfa_longest(dfa_cache_t *cache,
+                                        const regex_text_t *text,
+                                        size_t start, size_t *end,
+                                        size_t *steps) {
+  dfa_state_t *state = cache->start_state;
+  enum DFAResult result = DFA_NoMatch;
+
+  for (size_t pos = start;; pos++) {
+    if (state->is_accepting) {
+      *end = pos;
+      result = DFA_Match;
+    }
+
+    if (pos == text->length || state->num_states == 0)
+      return result;
+
+    state = dfa_cache_next(cache, state, regex_text_at(text, pos), true);
+    (*steps)++;
+
+    if (state == NULL)
+      return DFA_GaveUp;
+  }
+}
+
+// The DFA decides whether there is a match at all and where the earliest
+// one ends; the leftmost match starts no later than that. Candidate starts
+// are then probed left to right with the anchored DFA. Should failed probes
+// cost more than a few passes over that window, the thread simulation takes
+// over from the first start not yet ruled out.
+bool regex_search_scratch(const regex_compiled_t *re, regex_scratch_t *scratch,
+                          const regex_text_t *text, size_t from,
+                          regex_match_t *match) {
+  dfa_cache_t *cache = scratch->dfa;
+  size_t limit = 0;
+  size_t start = regex_prefilter_next(re, text, from, &limit);
+  size_t first_end = 0;
+
+  if (start == REGEX_NO_MATCH)
+    return false;
+
+  // A cache that filled up during an earlier search is rebuilt here rather
+  // than abandoned, so a long run over many lines keeps its DFA speed. If
+  // even the start state cannot be allocated, the threads do the search.
+  if (cache->num_states >= cache->max_states || cache->start_state == NULL)
+    dfa_cache_flush(cache);
+
+  if (cache->start_state == NULL)
+    return regex_search_threads(re, scratch, text, start, match);
+
+  switch (regex_dfa_first_end(re, cache, text, start, &first_end)) {
+  case DFA_NoMatch:
+    return false;
+  case DFA_GaveUp:
+    return regex_search_threads(re, scratch, text, start, match);
+  default:
+    break;
+  }
+
+  size_t budget = REGEX_PROBE_FACTOR * (first_end - start) + REGEX_PROBE_SLACK;
+  size_t steps = 0;
+
+  while (start != REGEX_NO_MATCH && start <= first_end) {
+    if (steps > budget)
+      break;
+
+    switch (regex_dfa_longest(cache, text, start, &match->end, &steps)) {
+    case DFA_Match:
+      match->start = start;
+      return true;
+    case DFA_GaveUp:
+      return regex_search_threads(re, scratch, text, start, match);
+    default:
+      break;
+    }
+
+    if (++start > limit)
+      start = regex_prefilter_next(re, text, start, &limit);
+  }
+
+  return regex_search_threads(re, scratch, text,
+                              start == REGEX_NO_MATCH ? from : start, match);
+}
+
+bool regex_search_text(regex_compiled_t *re, const regex_text_t *text,
+                       size_t from, regex_match_t *match) {
+  return regex_search_scratch(re, re->scratch, text, from, match);
+}
+
+bool regex_search(regex_compiled_t *re, const char32_t *text, size_t length,
+                  size_t from, regex_match_t *match) {
+  regex_text_t segments = regex_text_segments(text, length, NULL, 0);
+  return regex_search_text(re, &segments, from, match);
+}
+
+size_t regex_next_offset(const size_t *caps) {
+  return caps[1] > caps[0] ? caps[1] : caps[1] + 1;
+}
+
+// As in sed, an empty match right where the previous match ended is not a
+// match of its own: s/a*/X/g turns baaac into XbXcX, not XbXXcX.
+bool regex_match_adjacent(const size_t *caps, size_t last_end) {
+  return caps[0] == caps[1] && caps[0] == last_end;
+}
+
+regex_match_iter_t *regex_match_iter_new(regex_compiled_t *re,
+                                         txt_buffer_t *buffer,
+                                         size_t start_line, size_t end_line,
+                                         bool global) {
+  regex_match_iter_t *iter =
+      request_memory(current_arena, sizeof(regex_match_iter_t));
+
+  if (iter == NULL)
+    raise("Region allocation error");
+
+  iter->re = re;
+  iter->buffer = buffer;
+  iter->line = NULL;
+  iter->line_no = start_line;
+  txt_buffer_iter_init(&iter->lines, buffer, start_line);
+  iter->end_line = end_line < buffer->num_lines ? end_line : buffer->num_lines;
+  iter->offset = 0;
+  iter->last_end = REGEX_NO_MATCH;
+  iter->global = global;
+  return iter;
+}
+
+bool regex_match_iter_next(regex_match_iter_t *iter) {
+  while (iter->line_no < iter->end_line) {
+    if (iter->line == NULL)
+      iter->line = txt_buffer_iter_next(&iter->lines);
+
+    str_buffer_t *line = iter->line;
+
+    // Matches are stepped over exactly as regex_substitute steps over them,
+    // so the iterator finds what s/re/rep/g would replace.
+    while (iter->offset <= line->length &&
+           regex_search(iter->re, line->contents, line->length, iter->offset,
+                        &iter->match)) {
+      size_t caps[2] = {iter->match.start, iter->match.end};
+
+      if (iter->global && regex_match_adjacent(caps, iter->last_end)) {
+        iter->offset = caps[0] + 1;
+        continue;
+      }
+
+      iter->offset = iter->global ? regex_next_offset(caps) : line->length + 1;
+      iter->last_end = caps[1];
+      iter->match_line = iter->line_no;
+      return true;
+    }
+
+    iter->line_no++;
+    iter->line = NULL;
+    iter->offset = 0;
+    iter->last_end = REGEX_NO_MATCH;
+  }
+
+  return false;
+}
+
+static void regex_pike_add_thread(const regex_compiled_t *re,
+                                  regex_scratch_t *scratch,
+                                  nfa_state_set_t *set, size_t *caps_matrix,
+                                  int state, const size_t *caps, size_t pos) {
+  const nfa_prog_t *prog = re->prog;
+  regex_pike_frame_t *stack = scratch->pike_stack;
+  size_t top = 0;
+
+  stack[top].state = state;
+  stack[top++].caps = caps;
+
+  // Depth-first in transition order, so higher-priority threads claim each
+  // state first. A state's caps row is written once per step and serves as
+  // the parent row for everything reached through it.
+  while (top > 0) {
+    regex_pike_frame_t frame = stack[--top];
+
+    if (!nfa_state_set_insert(set, frame.state))
+      continue;
+
+    const nfa_state_t *from = &prog->states[frame.state];
+    size_t *row = &caps_matrix[frame.state * prog->num_slots];
+
+    memcpy(row, frame.caps, prog->num_slots * sizeof(size_t));
+    if (from->save_slot != NO_SLOT)
+      row[from->save_slot] = pos;
+
+    for (int i = from->num_eps_trans - 1; i >= 0; i--) {
+      stack[top].state = from->eps_trans[i].target;
+      stack[top++].caps = row;
+    }
+  }
+}
+
+static bool regex_pike_run(const regex_compiled_t *re,
+                           regex_scratch_t *scratch, const regex_text_t *text,
+                           size_t start, size_t end, size_t *caps) {
+  const nfa_prog_t *prog = re->prog;
+  nfa_state_set_t *current = scratch->threads[0];
+  nfa_state_set_t *next = scratch->threads[1];
+  size_t *current_caps = scratch->thread_caps[0];
+  size_t *next_caps = scratch->thread_caps[1];
+
+  nfa_state_set_clear(current);
+  regex_pike_add_thread(re, scratch, current, current_caps, prog->start_state,
+                        re->seed_caps, start);
+
+  for (size_t pos = start; pos < end; pos++) {
+    char32_t chr = regex_text_at(text, pos);
+    nfa_state_set_clear(next);
+
+    for (size_t i = 0; i < current->length; i++) {
+      int id = current->dense[i];
+      const nfa_trans_t *trans = &prog->states[id].trans;
+
+      if (trans->target != NO_STATE && trans->symbol == chr)
+        regex_pike_add_thread(re, scratch, next, next_caps, trans->target,
+                              &current_caps[id * prog->num_slots], pos + 1);
+    }
+
+    nfa_state_set_t *swap_set = current;
+    current = next;
+    next = swap_set;
+
+    size_t *swap_caps = current_caps;
+    current_caps = next_caps;
+    next_caps = swap_caps;
+  }
+
+  if (!nfa_state_set_contains(current, prog->accept_state))
+    return false;
+
+  memcpy(caps, &current_caps[prog->accept_state * prog->num_slots],
+         prog->num_slots * sizeof(size_t));
+  return true;
+}
+
+bool regex_search_captures_scratch(const regex_compiled_t *re,
+                                   regex_scratch_t *scratch,
+                                   const regex_text_t *text, size_t from,
+                                   size_t *caps) {
+  regex_match_t match;
+
+  // The linear search fixes the leftmost-longest span; the Pike VM then only
+  // runs across that span, anchored at both ends, to fill the groups.
+  if (!regex_search_scratch(re, scratch, text, from, &match))
+    return false;
+
+  return regex_pike_run(re, scratch, text, match.start, match.end, caps);
+}
+
+bool regex_search_captures_text(regex_compiled_t *re, const regex_text_t *text,
+                                size_t from, size_t *caps) {
+  return regex_search_captures_scratch(re, re->scratch, text, from, caps);
+}
+
+bool regex_search_captures(regex_compiled_t *re, const char32_t *text,
+                           size_t length, size_t from, size_t *caps) {
+  regex_text_t segments = regex_text_segments(text, length, NULL, 0);
+  return regex_search_captures_text(re, &segments, from, caps);
+}
+
+static str_buffer_t *regex_append_span(str_buffer_t *result,
+                                       const char32_t *text, size_t start,
+                                       size_t end) {
+  for (size_t i = start; i < end; i++)
+    result = str_buffer_add_char(result, text[i]);
+
+  return result;
+}
+
+static str_buffer_t *regex_expand_template(const regex_compiled_t *re,
+                                           str_buffer_t *result,
+                                           const char32_t *text,
+                                           const size_t *caps,
+                                           const char32_t *replace) {
+  for (size_t i = 0; replace[i] != U'\0'; i++) {
+    char32_t chr = replace[i];
+
+    if (chr == U'&') {
+      result = regex_append_span(result, text, caps[0], caps[1]);
+    } else if (chr == U'\\' && replace[i + 1] >= U'0' &&
+               replace[i + 1] <= U'9') {
+      size_t group = replace[++i] - U'0';
+
+      if (2 * group + 1 < re->prog->num_slots &&
+          caps[2 * group] != REGEX_NO_MATCH &&
+          caps[2 * group + 1] != REGEX_NO_MATCH)
+        result = regex_append_span(result, text, caps[2 * group],
+                                   caps[2 * group + 1]);
+    } else if (chr == U'\\' && replace[i + 1] != U'\0') {
+      result = str_buffer_add_char(result, replace[++i]);
+    } else {
+      result = str_buffer_add_char(result, chr);
+    }
+  }
+
+  return result;
+}
+
+static str_buffer_t *regex_substitute_one(const regex_compiled_t *re,
+                                          str_buffer_t *result,
+                                          const str_buffer_t *line,
+                                          const size_t *caps,
+                                          const char32_t *replace,
+                                          size_t *pos) {
+  result = regex_append_span(result, line->contents, *pos, caps[0]);
+  result = regex_expand_template(re, result, line->contents, caps, replace);
+
+  // An empty match still advances by one character, which is kept as is.
+  if (caps[1] == caps[0] && caps[1] < line->length)
+    result = str_buffer_add_char(result, line->contents[caps[1]]);
+
+  *pos = regex_next_offset(caps);
+  return result;
+}
+
+str_buffer_t *regex_substitute(regex_compiled_t *re, str_buffer_t *line,
+                               const char32_t *replace, bool global) {
+  size_t *caps = re->scratch->match_caps;
+  str_buffer_t *result = NULL;
+  size_t pos = 0, from = 0, last_end = REGEX_NO_MATCH;
+
+  while (from <= line->length &&
+         regex_search_captures(re, line->contents, line->length, from, caps)) {
+    if (regex_match_adjacent(caps, last_end)) {
+      from = caps[0] + 1;
+      continue;
+    }
+
+    if (result == NULL)
+      result = str_buffer_new_blank(line->length);
+
+    result = regex_substitute_one(re, result, line, caps, replace, &pos);
+    last_end = caps[1];
+    from = pos;
+
+    if (!global)
+      break;
+  }
+
+  if (result == NULL)
+    return line;
+
+  if (pos < line->length)
+    result = regex_append_span(result, line->contents, pos, line->length);
+
+  return result;
+}
+
+str_buffer_t *regex_substitute_matches(const regex_compiled_t *re,
+                                       const str_buffer_t *line,
+                                       const char32_t *replace,
+                                       const size_t *matches,
+                                       size_t num_matches, size_t stride) {
+  str_buffer_t *result = str_buffer_new_blank(line->length);
+  size_t pos = 0;
+
+  for (size_t i = 0; i < num_matches; i++)
+    result = regex_substitute_one(re, result, line, &matches[i * stride],
+                                  replace, &pos);
+
+  if (pos < line->length)
+    result = regex_append_span(result, line->contents, pos, line->length);
+
+  return result;
 }
@@ -0,0 +1,336 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <uchar.h>
+#include <unistd.h>
+
+#define SAVE_TEMP_SUFFIX ".XXXXXX"
+#define SAVE_BLOCK_CHARS 16384
+#define SAVE_WRITE_SIZE (1 << 20)
+
+typedef struct Save save_t;
+
+struct Save {
+  enum SAVESource {
+    SAVE_TxtBuffer,
+    SAVE_GapBuffer,
+  } source;
+  union {
+    txt_buffer_t *txt_snapshot;
+    gap_buffer_t *gap_snapshot;
+  };
+  char *path;
+  char *temp_path;
+  enum TABEncoding encoding;
+  journal_t *journal;
+  int fd;
+  uint8_t *output;
+  size_t output_length;
+  size_t encoded;
+  pthread_t writer;
+  pthread_mutex_t lock;
+  size_t done;
+  size_t total;
+  bool finished;
+  const char *failed_call;
+  int error;
+};
+
+static bool save_fail(save_t *save, const char *call) {
+  save->error = errno;
+  save->failed_call = call;
+  return false;
+}
+
+// Everything encoded so far goes out in one write, and only then is it
+// counted as progress.
+static bool save_flush(save_t *save) {
+  for (size_t done = 0; done < save->output_length;) {
+    ssize_t put = write(save->fd, &save->output[done],
+                        save->output_length - done);
+
+    if (put < 0 && errno == EINTR)
+      continue;
+    if (put < 0)
+      return save_fail(save, "write");
+
+    done += put;
+  }
+
+  save->output_length = 0;
+
+  pthread_mutex_lock(&save->lock);
+  save->done = save->encoded;
+  pthread_mutex_unlock(&save->lock);
+  return true;
+}
+
+// Files are written back in the encoding they were read in. No code point
+// takes more than four bytes in either, so a block always fits once the
+// output has room for it as UTF-32.
+static bool save_put_span(save_t *save, const char32_t *text, size_t length) {
+  while (length > 0) {
+    size_t block = length < SAVE_BLOCK_CHARS ? length : SAVE_BLOCK_CHARS;
+
+    if (save->output_length + block * sizeof(char32_t) > SAVE_WRITE_SIZE &&
+        !save_flush(save))
+      return false;
+
+    uint8_t *out = &save->output[save->output_length];
+
+    switch (save->encoding) {
+    case ENCODING_Utf8:
+      save->output_length += utf8_encode(text, block, out);
+      break;
+    case ENCODING_Utf32Swapped:
+      for (size_t i = 0; i < block; i++)
+        ((char32_t *)out)[i] = __builtin_bswap32(text[i]);
+
+      save->output_length += block * sizeof(char32_t);
+      break;
+    default:
+      memcpy(out, text, block * sizeof(char32_t));
+      save->output_length += block * sizeof(char32_t);
+      break;
+    }
+
+    text += block;
+    length -= block;
+  }
+
+  return true;
+}
+
+static bool save_write_text(save_t *save) {
+  txt_iter_t iter;
+  str_buffer_t *line;
+
+  txt_buffer_iter_init(&iter, save->txt_snapshot, 0);
+
+  while ((line = txt_buffer_iter_next(&iter)) != NULL) {
+    if (!save_put_span(save, line->contents, line->length))
+      return false;
+
+    save->encoded++;
+  }
+
+  return true;
+}
+
+static bool save_write_gap(save_t *save) {
+  char32_t chars[SAVE_BLOCK_CHARS];
+
+  while (save->encoded < save->total) {
+    size_t block = save->total - save->encoded;
+
+    if (block > SAVE_BLOCK_CHARS)
+      block = SAVE_BLOCK_CHARS;
+
+    gap_buffer_copy_out(save->gap_snapshot, save->encoded, block, chars);
+
+    if (!save_put_span(save, chars, block))
+      return false;
+
+    save->encoded += block;
+  }
+
+  return true;
+}
+
+static bool save_sync_directory(const char *path) {
+  const char *slash = strrchr(path, '/');
+  char *directory = slash == NULL ? strdup(".")
+                                  : strndup(path, slash == path ? 1
+                                                                : slash - path);
+
+  if (directory == NULL)
+    return false;
+
+  int fd = open(directory, O_RDONLY | O_DIRECTORY);
+
+  free(directory);
+
+  if (fd < 0)
+    return false;
+
+  bool synced = fsync(fd) == 0;
+
+  close(fd);
+  return synced;
+}
+
+static void *save_write_loop(void *arg) {
+  save_t *save = arg;
+  char32_t bom = 0xFEFF;
+
+  // UTF-32 files lead with a BOM so the readers recover the byte order.
+  bool written = (save->encoding == ENCODING_Utf8 ||
+                  save_put_span(save, &bom, 1)) &&
+                 (save->source == SAVE_TxtBuffer ? save_write_text(save)
+                                                 : save_write_gap(save));
+
+  // The document is only ever replaced by a complete, synced file, so a crash
+  // mid-save leaves the previous version in place.
+  if (written && !save_flush(save))
+    written = false;
+  if (written && fsync(save->fd) != 0)
+    written = save_fail(save, "fsync");
+  if (close(save->fd) != 0 && written)
+    written = save_fail(save, "close");
+  if (written && rename(save->temp_path, save->path) != 0)
+    written = save_fail(save, "rename");
+  if (written && !save_sync_directory(save->path))
+    written = save_fail(save, "fsync");
+
+  if (!written)
+    unlink(save->temp_path);
+
+  pthread_mutex_lock(&save->lock);
+  save->finished = true;
+  pthread_mutex_unlock(&save->lock);
+  return NULL;
+}
+
+static save_t *save_open(const char *path, enum TABEncoding encoding,
+                         journal_t *journal) {
+  size_t length = strlen(path);
+  save_t *save = malloc(sizeof(save_t));
+
+  if (save == NULL)
+    raise("Memory allocation error");
+
+  save->path = malloc(length + 1);
+  save->temp_path = malloc(length + sizeof(SAVE_TEMP_SUFFIX));
+  save->output = malloc(SAVE_WRITE_SIZE);
+
+  if (save->path == NULL || save->temp_path == NULL || save->output == NULL)
+    raise("Memory allocation error");
+
+  memcpy(save->path, path, length + 1);
+  memcpy(save->temp_path, path, length);
+  memcpy(&save->temp_path[length], SAVE_TEMP_SUFFIX, sizeof(SAVE_TEMP_SUFFIX));
+
+  // The temporary sits next to the document so the final rename stays on
+  // one filesystem and is atomic.
+  save->fd = mkstemp(save->temp_path);
+
+  if (save->fd < 0)
+    errno_raise("mkstemp");
+
+  struct stat info;
+  mode_t mode;
+
+  if (stat(path, &info) == 0) {
+    mode = info.st_mode & 07777;
+  } else {
+    mode_t mask = umask(0);
+
+    umask(mask);
+    mode = 0666 & ~mask;
+  }
+
+  if (fchmod(save->fd, mode) != 0)
+    errno_raise("fchmod");
+
+  save->encoding = encoding;
+  save->journal = journal;
+  save->output_length = 0;
+  save->encoded = 0;
+  save->done = 0;
+  save->total = 0;
+  save->finished = false;
+  save->failed_call = NULL;
+  save->error = 0;
+  pthread_mutex_init(&save->lock, NULL);
+  return save;
+}
+
+static save_t *save_launch(save_t *save) {
+  if (pthread_create(&save->writer, NULL, save_write_loop, save) != 0)
+    raise("Save thread creation error");
+
+  return save;
+}
+
+// Both snapshots are O(1) and the writer only ever reads them, so editing
+// carries on while the file is encoded and written. The journal, if any, is
+// marked at the snapshot so that a finished save drops only what it holds.
+save_t *save_text_buffer(txt_buffer_t *buffer, const char *path,
+                         enum TABEncoding encoding, journal_t *journal) {
+  save_t *save = save_open(path, encoding, journal);
+
+  save->source = SAVE_TxtBuffer;
+  save->txt_snapshot = txt_buffer_clone(buffer);
+  save->total = save->txt_snapshot->num_lines;
+
+  if (journal != NULL)
+    journal_begin_save(journal);
+
+  return save_launch(save);
+}
+
+save_t *save_gap_buffer(gap_buffer_t *buffer, const char *path,
+                        enum TABEncoding encoding, journal_t *journal) {
+  save_t *save = save_open(path, encoding, journal);
+
+  save->source = SAVE_GapBuffer;
+  save->gap_snapshot = gap_buffer_clone(buffer);
+  save->total = gap_buffer_length(save->gap_snapshot);
+
+  if (journal != NULL)
+    journal_begin_save(journal);
+
+  return save_launch(save);
+}
+
+// Progress is counted in lines for a text buffer and in characters for a
+// gap buffer.
+bool save_poll(save_t *save, size_t *done, size_t *total) {
+  pthread_mutex_lock(&save->lock);
+
+  bool finished = save->finished;
+
+  if (done != NULL)
+    *done = save->done;
+  if (total != NULL)
+    *total = save->total;
+
+  pthread_mutex_unlock(&save->lock);
+  return finished;
+}
+
+// Waits for the writer if it is still running. Snapshot reference counts are
+// not atomic and the snapshot lives in the buffer's arena, so it is released
+// here on the editing thread, before the buffer's tab may be closed.
+void save_finish(save_t *save) {
+  pthread_join(save->writer, NULL);
+
+  if (save->source == SAVE_TxtBuffer)
+    txt_buffer_free(save->txt_snapshot);
+  else
+    gap_buffer_free(save->gap_snapshot);
+
+  const char *failed_call = save->failed_call;
+  int error = save->error;
+  journal_t *journal = save->journal;
+
+  pthread_mutex_destroy(&save->lock);
+  free(save->path);
+  free(save->temp_path);
+  free(save->output);
+  free(save);
+
+  if (journal != NULL)
+    journal_end_save(journal, failed_call == NULL);
+
+  if (failed_call != NULL) {
+    errno = error;
+    errno_raise(failed_call);
+  }
+}